@@ -29,6 +29,9 @@
 #include <linux/version.h>
 #include <linux/blkdev.h>
 #include <linux/bio.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
 #include <linux/fs.h>
 #else
@@ -38,19 +41,132 @@
 #include <linux/kobject.h>
 #include <linux/sysfs.h>
 #include <linux/errno.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/cpu.h>
+#include <linux/nodemask.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+#include <linux/xarray.h>
+#else
 #include <linux/radix-tree.h>
+#endif
 #include <linux/io.h>
 
+/* Large folio backing needs multi-index XArray entries and the folio API. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0) && defined(CONFIG_XARRAY_MULTI)
+#define RDSK_LARGE_FOLIOS
+#endif
+
+/* The compression tier needs zsmalloc and the reworked in-kernel zstd API. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0) && IS_ENABLED(CONFIG_ZSMALLOC)
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+#include <linux/lz4.h>
+#define RDSK_LZ4
+#endif
+#if IS_ENABLED(CONFIG_ZSTD_COMPRESS) && IS_ENABLED(CONFIG_ZSTD_DECOMPRESS)
+#include <linux/zstd.h>
+#define RDSK_ZSTD
+#endif
+#if defined(RDSK_LZ4) || defined(RDSK_ZSTD)
+#include <linux/zsmalloc.h>
+#include <linux/highmem.h>
+#define RDSK_COMPRESS
+#endif
+#endif
+
+/* The mirror file needs kernel_read()/kernel_write() with a position argument. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+#include <linux/kthread.h>
+#include <linux/falloc.h>
+#include <linux/bitmap.h>
+#include <linux/vmalloc.h>
+#define RDSK_MIRROR
+#endif
+
+/* The bio path allocates the pages of a whole window with the bulk page allocator. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,14,0)
+#define RDSK_BULK_IO
+#endif
+
+/* Flush and detach free the page index in the background, one XArray per work item. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+#define RDSK_ASYNC_TEARDOWN
+#endif
+
+/* Reserved pages are recycled from the RCU callbacks that free unlinked pages. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+#define RDSK_RESERVE
+#endif
+
+/* /dev/rdN_mem maps the device's pages; it relies on vm_fault_t and queue freezing. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+#include <linux/miscdevice.h>
+#define RDSK_MEMDEV
+#endif
+
+/* Bio based drivers account their I/O in /proc/diskstats with bio_start_io_acct(). */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+#define RDSK_IO_ACCT
+#endif
+
+/*
+ * Pages can be handed to compaction through movable_operations; 6.17
+ * restricted those to a fixed set of page types.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0) && LINUX_VERSION_CODE < KERNEL_VERSION(6,17,0) && \
+	IS_ENABLED(CONFIG_COMPACTION)
+#include <linux/migrate.h>
+#define RDSK_MOVABLE
+#endif
+
+/* Bio based queues can be flagged to take REQ_NOWAIT bios. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,10,0)
+#define RDSK_NOWAIT
+#endif
+
+/* Zoned emulation needs queue_limits features and zone write plugging. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,11,0) && IS_ENABLED(CONFIG_BLK_DEV_ZONED)
+#define RDSK_ZONED
+#endif
+
+/* The blk-mq mode relies on batched completions for polled queues. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+#include <linux/blk-mq.h>
+#define RDSK_BLK_MQ
+#endif
+
+#define CREATE_TRACE_POINTS
+#include "rapiddisk_trace.h"
+
 #define VERSION_STR		"9.2.0"
 #define PREFIX			"rapiddisk"
 #define BYTES_PER_SECTOR	512
-#define MAX_RDSKS		1024
+#define MAX_RDSKS		65536
+#define RDSK_DEVICES_LINE	96	/* longest line of /sys/kernel/rapiddisk/devices */
 #define DEFAULT_MAX_SECTS	127
 #define DEFAULT_REQUESTS	128
 #define GENERIC_ERROR		-1
 #define SUCCESS			0
 
 #define FREE_BATCH		16
+#define RDSK_SHARDS		32	/* must be a power of two */
+#define RDSK_SHARD_SHIFT	9	/* 2 MB worth of pages per shard stripe */
+#define RDSK_LAT_SHIFT		8	/* first latency bucket: < 256 ns */
+#define RDSK_LAT_BUCKETS	20	/* last latency bucket: >= 67 ms */
+#define RDSK_RCU_BATCH_SIZE	512	/* bytes per deferred free batch */
+#define RDSK_ZLOCKS		256	/* hashed compressed page locks, must be a power of two */
+#define RDSK_ZMAX		(PAGE_SIZE / 4 * 3)	/* store pages raw above this */
+#define RDSK_ZSTD_LEVEL		3
+#define RDSK_MIRROR_BATCH	64	/* pages per mirror file write (256 KB) */
+#define RDSK_MIRROR_INTERVAL	1000	/* ms between mirror flush passes */
+#define RDSK_BIO_WINDOW		32	/* pages resolved per index walk, at most BITS_PER_LONG */
+#define RDSK_ZONE_SIZE		(256ULL << 20)	/* default zone size in zoned mode */
+#define RDSK_WATERMARKS		4	/* usage watermarks per device */
+#define RDSK_WM_DELAY		(HZ / 10)	/* coalesce usage changes before a check */
+#define RDSK_PCP_PAGES		64	/* pages in each per-CPU recycle cache */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,8,0)
+#define N_MEMORY		N_HIGH_MEMORY
+#endif
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,15,0)
 #if (defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
 	/* Not sure of a cleaner way to do this. */
@@ -73,26 +189,259 @@
 static DEFINE_MUTEX(sysfs_mutex);
 static DEFINE_MUTEX(ioctl_mutex);
 
+enum rdsk_queue_mode {
+	RDSK_QUEUE_BIO = 0,	/* default: bio-based, completes inline */
+	RDSK_QUEUE_MQ,		/* blk-mq with per-CPU and polled hardware queues */
+};
+
+/*
+ * The page index is split into RDSK_SHARDS independent trees. Consecutive
+ * stripes of (1 << RDSK_SHARD_SHIFT) pages rotate across the shards, so
+ * concurrent first-touch writes to different regions of the device do not
+ * serialize on a single lock. Lookups are lockless (RCU) in both cases.
+ */
+struct rdsk_shard {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	struct xarray pages;
+#ifdef RDSK_MOVABLE
+	rwlock_t mig_lock;	/* held for reading while page contents are copied */
+#endif
+#else
+	spinlock_t lock;
+	struct radix_tree_root pages;
+#endif
+} ____cacheline_aligned_in_smp;
+
+enum rdsk_numa_policy {
+	RDSK_NUMA_LOCAL = 0,	/* default: node of the allocating CPU */
+	RDSK_NUMA_INTERLEAVE,	/* round robin across nodes with memory, by page index */
+	RDSK_NUMA_BIND,		/* only from numa_node */
+};
+
+enum rdsk_comp_algo {
+	RDSK_COMP_NONE = 0,
+	RDSK_COMP_LZ4,
+	RDSK_COMP_ZSTD,
+};
+
+enum rdsk_stat_op {
+	RDSK_STAT_READ = 0,
+	RDSK_STAT_WRITE,
+	RDSK_STAT_DISCARD,	/* discard and write zeroes */
+	RDSK_STAT_NR,
+};
+
+/*
+ * Per-CPU I/O and page statistics. Every submitting CPU only ever touches
+ * its own copy; readers sum all of them on demand.
+ */
+struct rdsk_stats {
+	u64 ios[RDSK_STAT_NR];
+	u64 bytes[RDSK_STAT_NR];
+	u64 lat[RDSK_STAT_NR][RDSK_LAT_BUCKETS];	/* log2 buckets in ns */
+	u64 page_allocs;
+	u64 page_frees;
+	u64 alloc_fails;
+	u64 zero_elided;	/* all-zero page writes that dropped the page instead */
+	u64 cow_copies;		/* shared pages copied on first write */
+	u64 nt_bytes;		/* bytes written with non-temporal stores */
+	u64 pool_allocs;	/* pages taken from the reserve pool */
+	u64 nowait_again;	/* REQ_NOWAIT bios that would have blocked */
+	u64 migrated;		/* pages moved by compaction */
+	u64 errors;		/* failed I/Os */
+	s64 pages;		/* pages currently in use, may go negative per CPU */
+};
+
+#ifdef RDSK_COMPRESS
+/* One compressed page. A zero length means the index is not populated. */
+struct rdsk_zentry {
+	unsigned long handle;
+	unsigned int len;	/* PAGE_SIZE if stored uncompressed */
+};
+
+/* Per-CPU compression context. The mutex lets the holder sleep in zs_malloc(). */
+struct rdsk_zstrm {
+	struct mutex lock;
+	void *buf;		/* page sized scratch for partial page writes */
+	void *cbuf;		/* compressor output, 2 * PAGE_SIZE */
+	void *wrkmem;		/* LZ4 work memory or the zstd workspaces */
+#ifdef RDSK_ZSTD
+	zstd_cctx *cctx;
+	zstd_dctx *dctx;
+#endif
+};
+
+/*
+ * Compressed devices keep a flat table of zsmalloc handles instead of the
+ * page index. Every page is compressed on its own, so a read or write only
+ * ever has to touch one object under its hashed lock.
+ */
+struct rdsk_comp {
+	enum rdsk_comp_algo algo;
+	struct zs_pool *pool;
+	struct rdsk_zentry *table;
+	unsigned long nr_pages;
+	struct rdsk_zstrm __percpu *strm;
+	atomic64_t stored;	/* sum of all compressed lengths */
+	struct mutex locks[RDSK_ZLOCKS];
+};
+#endif
+
+#ifdef RDSK_MIRROR
+/*
+ * Write-behind copy of the device in a regular file. The I/O path only sets
+ * bits in the dirty bitmap; a kernel thread copies the dirty pages out once
+ * per interval. A second bitmap with one bit per shard stripe lets the
+ * thread skip clean regions of large devices without scanning every word.
+ */
+struct rdsk_mirror {
+	char *path;
+	struct file *filp;
+	unsigned long nr_pages;
+	unsigned long *dirty;		/* one bit per page */
+	unsigned long *dirty_chunks;	/* one bit per stripe with a dirty page */
+	unsigned int rate;		/* MB/s, 0 for unlimited */
+	struct task_struct *task;
+	struct mutex lock;		/* held for a flush pass */
+	void *buf;			/* RDSK_MIRROR_BATCH pages */
+	unsigned long synced;		/* jiffies: all writes before this are on disk */
+	u64 bytes_written;
+	unsigned long errors;
+};
+#endif
+
+#ifdef RDSK_ZONED
+/*
+ * Host managed zoned emulation. The first nr_conv zones are conventional,
+ * the others must be written sequentially at their write pointer. One lock
+ * covers the zone conditions and the open/active counts; the data itself
+ * is copied outside of it.
+ */
+struct rdsk_zone {
+	sector_t start;
+	sector_t wp;
+	enum blk_zone_cond cond;
+};
+
+struct rdsk_zoned {
+	spinlock_t lock;
+	unsigned int zone_shift;	/* log2 of the zone size in sectors */
+	unsigned int nr_zones;
+	unsigned int nr_conv;
+	unsigned int max_open, max_active;	/* 0 for no limit */
+	unsigned int nr_open, nr_active;
+	unsigned int close_hint;	/* where to look for a zone to close implicitly */
+	struct rdsk_zone zones[];
+};
+#endif
+
+#ifdef RDSK_RESERVE
+/* Recently freed pages of one CPU; other CPUs only look here when the pool runs dry. */
+struct rdsk_pcp {
+	spinlock_t lock;
+	unsigned int nr;
+	struct page *pages[RDSK_PCP_PAGES];
+};
+
+/*
+ * Pages set aside for one device by reserve=. Pages the device frees are
+ * kept here until the pool holds the whole reservation again, so that the
+ * pages in use plus the pages in the pool never drop below it.
+ */
+struct rdsk_pool {
+	spinlock_t lock;			/* protects free */
+	struct list_head free;			/* linked through page->lru */
+	unsigned long reserve;			/* pages guaranteed to the device */
+	atomic_long_t nr;			/* pages held, on the list and in the caches */
+	struct rdsk_pcp __percpu *pcp;
+};
+#endif
+
 struct rdsk_device {
 	int num;
+	struct kobject kobj;			/* /sys/kernel/rapiddisk/rdN */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,14,0)
 	struct request_queue *rdsk_queue;
 #endif
 	struct gendisk *rdsk_disk;
-	struct list_head rdsk_list;
-	unsigned long long max_blk_alloc;	/* rdsk: to keep track of highest sector write	*/
-	unsigned long long max_page_cnt;
+	atomic64_t max_blk_alloc;		/* rdsk: to keep track of highest sector write	*/
+	struct rdsk_stats __percpu *stats;
 	unsigned long long size;
-	unsigned long error_cnt;
-	spinlock_t rdsk_lock;
-	struct radix_tree_root rdsk_pages;
+	unsigned int page_order;		/* order of each backing allocation */
+	enum rdsk_queue_mode queue_mode;
+	bool prealloc;				/* fully populated, I/O never allocates */
+	bool movable;				/* pages may be migrated by compaction */
+	bool mig_gone;				/* detaching, pages must no longer move */
+	enum rdsk_numa_policy numa_policy;
+	int numa_node;				/* RDSK_NUMA_BIND target */
+	long __percpu *node_pages;		/* pages in use per NUMA node (nr_node_ids) */
+	enum rdsk_comp_algo comp_algo;
+	bool cow;				/* may share pages with a clone */
+	unsigned int nt_threshold;		/* write bios this large bypass the CPU caches, 0 = never */
+#ifdef RDSK_COMPRESS
+	struct rdsk_comp *comp;			/* NULL unless comp_algo is set */
+#endif
+#ifdef RDSK_MIRROR
+	struct rdsk_mirror *mirror;		/* NULL unless mirror= was given */
+#endif
+#ifdef RDSK_ZONED
+	struct rdsk_zoned *zoned;		/* NULL unless zoned was given */
+#endif
+#ifdef RDSK_RESERVE
+	unsigned long reserve;			/* pages requested by reserve= */
+	struct rdsk_pool *pool;			/* NULL unless reserve= was given */
+#endif
+#ifdef RDSK_MEMDEV
+	struct miscdevice mem_dev;		/* /dev/rdN_mem */
+	char mem_name[16];
+	struct mutex mem_lock;			/* orders mmap() against flush, shrink, clone, detach */
+	unsigned int mem_users;			/* open files of mem_dev */
+	bool mem_gone;				/* mem_dev is (being) removed or never registered */
+	atomic_t mem_maps;			/* mappings of mem_dev */
+#endif
+#ifdef RDSK_BLK_MQ
+	unsigned int nr_poll_queues;
+	struct blk_mq_tag_set tag_set;
+	struct rdsk_mq_queue *mq_queues;
+#endif
+	struct mutex wm_lock;			/* serializes watermark updates and notifications */
+	unsigned int wm[RDSK_WATERMARKS];	/* usage watermarks in percent, ascending */
+	unsigned int wm_nr;			/* 0 disables the watermarks */
+	unsigned int wm_level;			/* number of watermarks reached */
+	bool wm_gone;				/* detaching, the sysfs files are going away */
+	struct delayed_work wm_work;
+	struct rdsk_shard *rdsk_shards;		/* RDSK_SHARDS entries, replaced by a flush */
+};
+
+#ifdef RDSK_BLK_MQ
+/* Per hardware queue context; polled requests wait here for ->poll(). */
+struct rdsk_mq_queue {
+	spinlock_t lock;
+	struct list_head poll_list;
+} ____cacheline_aligned_in_smp;
+
+/* Per request driver data (tag_set.cmd_size). */
+struct rdsk_mq_cmd {
+	struct work_struct work;
+	blk_status_t status;
+	u64 start_ns;
 };
+#endif
 
 static unsigned long rd_max_nr = MAX_RDSKS, rd_ma_no, rd_total; /* no. of attached devices */
 static unsigned long rd_size = 0, rd_nr = 0;
 static int max_sectors = DEFAULT_MAX_SECTS, nr_requests = DEFAULT_REQUESTS;
-static LIST_HEAD(rdsk_devices);
+/*
+ * Attached devices, indexed by their minor number. The index only changes
+ * under sysfs_mutex, or at module load and unload.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+static DEFINE_XARRAY(rdsk_devices);
+#else
+static RADIX_TREE(rdsk_devices, GFP_KERNEL);
+#endif
 static struct kobject *rdsk_kobj;
+static struct workqueue_struct *rdsk_wq;
 
 module_param(max_sectors, int, S_IRUGO);
 MODULE_PARM_DESC(max_sectors, " Maximum sectors (in KB) for the request queue. (Default = 127)");
@@ -103,13 +452,205 @@ MODULE_PARM_DESC(rd_nr, " Maximum number of RapidDisk devices to load on inserti
 module_param(rd_size, ulong, S_IRUGO);
 MODULE_PARM_DESC(rd_size, " Size of each RAM disk (in MB) loaded on insertion. (Default = 0)");
 module_param(rd_max_nr, ulong, S_IRUGO);
-MODULE_PARM_DESC(rd_max_nr, " Maximum number of RAM Disks. (Default = 1024)");
+MODULE_PARM_DESC(rd_max_nr, " Maximum number of RAM Disks. (Default = 65536)");
+
+/*
+ * Usage changed; have rdsk_wm_fn() compare it against the watermarks soon.
+ * Summing the per-CPU counters on every allocation would be too costly, so
+ * all changes within RDSK_WM_DELAY are checked at once.
+ */
+static inline void rdsk_wm_kick(struct rdsk_device *rdsk)
+{
+	if (unlikely(READ_ONCE(rdsk->wm_nr) || READ_ONCE(rdsk->wm_level)) &&
+	    !delayed_work_pending(&rdsk->wm_work))
+		queue_delayed_work(rdsk_wq, &rdsk->wm_work, RDSK_WM_DELAY);
+}
+
+static inline void rdsk_count_pages(struct rdsk_device *rdsk, long nr)
+{
+	this_cpu_add(rdsk->stats->pages, nr);
+	if (nr > 0) {
+		this_cpu_add(rdsk->stats->page_allocs, nr);
+		trace_rapiddisk_page_alloc(rdsk->num, nr);
+	}
+	rdsk_wm_kick(rdsk);
+}
+
+static inline void rdsk_count_frees(struct rdsk_device *rdsk, unsigned long nr)
+{
+	this_cpu_sub(rdsk->stats->pages, nr);
+	this_cpu_add(rdsk->stats->page_frees, nr);
+	trace_rapiddisk_page_free(rdsk->num, nr);
+	rdsk_wm_kick(rdsk);
+}
+
+static inline void rdsk_count_alloc_fail(struct rdsk_device *rdsk, pgoff_t idx)
+{
+	this_cpu_inc(rdsk->stats->alloc_fails);
+	trace_rapiddisk_alloc_fail(rdsk->num, idx);
+}
+
+static inline void rdsk_count_node(struct rdsk_device *rdsk, struct page *page, long nr)
+{
+	this_cpu_add(rdsk->node_pages[page_to_nid(page)], nr);
+}
+
+static inline void rdsk_count_error(struct rdsk_device *rdsk)
+{
+	this_cpu_inc(rdsk->stats->errors);
+}
+
+/* Raise the highest written sector to end, racing writers only ever move it up. */
+static inline void rdsk_note_written(struct rdsk_device *rdsk, sector_t end)
+{
+	s64 old = atomic64_read(&rdsk->max_blk_alloc);
+
+	while (old < (s64)end) {
+		s64 prev = atomic64_cmpxchg(&rdsk->max_blk_alloc, old, end);
+
+		if (prev == old)
+			break;
+		old = prev;
+	}
+}
+
+static void rdsk_account_io(struct rdsk_device *rdsk, enum rdsk_stat_op op,
+			    unsigned int bytes, u64 start_ns)
+{
+	u64 delta = ktime_get_ns() - start_ns;
+	int bucket = fls64(delta >> RDSK_LAT_SHIFT);
+
+	if (bucket >= RDSK_LAT_BUCKETS)
+		bucket = RDSK_LAT_BUCKETS - 1;
+	this_cpu_inc(rdsk->stats->ios[op]);
+	this_cpu_add(rdsk->stats->bytes[op], bytes);
+	this_cpu_inc(rdsk->stats->lat[op][bucket]);
+}
+
+static inline enum rdsk_stat_op rdsk_bio_stat_op(struct bio *bio)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	if (bio_op(bio) == REQ_OP_DISCARD || bio_op(bio) == REQ_OP_WRITE_ZEROES)
+		return RDSK_STAT_DISCARD;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+	if (bio_op(bio) == REQ_OP_DISCARD)
+		return RDSK_STAT_DISCARD;
+#else
+	if (bio->bi_rw & REQ_DISCARD)
+		return RDSK_STAT_DISCARD;
+#endif
+	return bio_data_dir(bio) == WRITE ? RDSK_STAT_WRITE : RDSK_STAT_READ;
+}
+
+/* Operation name reported by the rapiddisk_submit and rapiddisk_complete events. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+static const char *rdsk_op_name(unsigned int op)
+{
+	switch (op) {
+	case REQ_OP_READ:
+		return "read";
+	case REQ_OP_WRITE:
+		return "write";
+	case REQ_OP_FLUSH:
+		return "flush";
+	case REQ_OP_DISCARD:
+		return "discard";
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	case REQ_OP_WRITE_ZEROES:
+		return "write_zeroes";
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+	case REQ_OP_ZONE_APPEND:
+		return "zone_append";
+#endif
+	default:
+		break;
+	}
+#ifdef RDSK_ZONED
+	if (op_is_zone_mgmt(op))
+		return "zone_mgmt";
+#endif
+	return "other";
+}
+#endif
+
+static const char *rdsk_bio_op_name(struct bio *bio)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+	return rdsk_op_name(bio_op(bio));
+#else
+	if (bio->bi_rw & REQ_DISCARD)
+		return "discard";
+	return bio_data_dir(bio) == WRITE ? "write" : "read";
+#endif
+}
+
+/* Sum all per-CPU copies into *sum. */
+static void rdsk_stats_sum(struct rdsk_device *rdsk, struct rdsk_stats *sum)
+{
+	int cpu, op, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		struct rdsk_stats *st = per_cpu_ptr(rdsk->stats, cpu);
+
+		for (op = 0; op < RDSK_STAT_NR; op++) {
+			sum->ios[op] += st->ios[op];
+			sum->bytes[op] += st->bytes[op];
+			for (i = 0; i < RDSK_LAT_BUCKETS; i++)
+				sum->lat[op][i] += st->lat[op][i];
+		}
+		sum->page_allocs += st->page_allocs;
+		sum->page_frees += st->page_frees;
+		sum->alloc_fails += st->alloc_fails;
+		sum->zero_elided += st->zero_elided;
+		sum->pages += st->pages;
+		sum->cow_copies += st->cow_copies;
+		sum->nt_bytes += st->nt_bytes;
+		sum->pool_allocs += st->pool_allocs;
+		sum->nowait_again += st->nowait_again;
+		sum->migrated += st->migrated;
+		sum->errors += st->errors;
+	}
+}
+
+static unsigned long long rdsk_error_count(struct rdsk_device *rdsk)
+{
+	u64 errors = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		errors += per_cpu_ptr(rdsk->stats, cpu)->errors;
+
+	return errors;
+}
+
+static unsigned long long rdsk_page_count(struct rdsk_device *rdsk)
+{
+	s64 pages = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		pages += per_cpu_ptr(rdsk->stats, cpu)->pages;
+
+	return pages > 0 ? pages : 0;
+}
+
+/* Memory actually consumed, which is less than the stored pages when compressed. */
+static unsigned long long rdsk_used_pages(struct rdsk_device *rdsk)
+{
+#ifdef RDSK_COMPRESS
+	if (rdsk->comp)
+		return zs_get_total_pages(rdsk->comp->pool);
+#endif
+	return rdsk_page_count(rdsk);
+}
 
 static int rdsk_do_bvec(struct rdsk_device *, struct page *,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
-			unsigned int, unsigned int, bool, sector_t);
+			unsigned int, unsigned int, bool, sector_t, gfp_t);
 #else
-			unsigned int, unsigned int, int, sector_t);
+			unsigned int, unsigned int, int, sector_t, gfp_t);
 #endif
 static int rdsk_ioctl(struct block_device *, fmode_t,
 		      unsigned int, unsigned long);
@@ -130,13 +671,72 @@ static void rdsk_make_request(struct request_queue *, struct bio *);
 #else
 static int rdsk_make_request(struct request_queue *, struct bio *);
 #endif
-static int attach_device(unsigned long, unsigned long long); /* disk size */
+#ifdef RDSK_ZONED
+static void rdsk_zones_empty(struct rdsk_device *);
+#endif
+static int attach_device(unsigned long, unsigned long long, char *,
+			 struct rdsk_device *);		     /* disk num, disk size, options, clone source */
 static int detach_device(unsigned long);                     /* disk num */
 static int resize_device(unsigned long, unsigned long long); /* disk num, disk size */
+static int clone_device(unsigned long, unsigned long);	     /* source disk num, disk num */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+static unsigned long rdsk_shared_pages(struct rdsk_device *);
+static int rdsk_clone_pages(struct rdsk_device *, struct rdsk_device *); /* clone, source */
+static unsigned int rdsk_freeze(struct rdsk_device *);
+static void rdsk_unfreeze(struct rdsk_device *, unsigned int);
+#endif
 static ssize_t mgmt_show(struct kobject *, struct kobj_attribute *, char *);
 static ssize_t mgmt_store(struct kobject *, struct kobj_attribute *,
 			  const char *, size_t);
 static ssize_t devices_show(struct kobject *, struct kobj_attribute *, char *);
+#ifdef RDSK_ASYNC_TEARDOWN
+static ssize_t teardown_show(struct kobject *, struct kobj_attribute *, char *);
+#endif
+
+static struct rdsk_device *rdsk_find_device(unsigned long num)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	return xa_load(&rdsk_devices, num);
+#else
+	return radix_tree_lookup(&rdsk_devices, num);
+#endif
+}
+
+/* The attached device with the lowest number at or above *num, which is updated to it. */
+static struct rdsk_device *rdsk_next_device(unsigned long *num)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	return xa_find(&rdsk_devices, num, ULONG_MAX, XA_PRESENT);
+#else
+	struct rdsk_device *rdsk;
+
+	if (!radix_tree_gang_lookup(&rdsk_devices, (void **)&rdsk, *num, 1))
+		return NULL;
+	*num = rdsk->num;
+	return rdsk;
+#endif
+}
+
+#define rdsk_for_each_device(rdsk, num) \
+	for ((num) = 0; ((rdsk) = rdsk_next_device(&(num))) != NULL; (num)++)
+
+static int rdsk_add_device(struct rdsk_device *rdsk)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	return xa_insert(&rdsk_devices, rdsk->num, rdsk, GFP_KERNEL);
+#else
+	return radix_tree_insert(&rdsk_devices, rdsk->num, rdsk);
+#endif
+}
+
+static void rdsk_del_device(struct rdsk_device *rdsk)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	xa_erase(&rdsk_devices, rdsk->num);
+#else
+	radix_tree_delete(&rdsk_devices, rdsk->num);
+#endif
+}
 
 static ssize_t mgmt_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
@@ -150,21 +750,34 @@ static ssize_t mgmt_show(struct kobject *kobj, struct kobj_attribute *attr, char
 	return len;
 }
 
+/*
+ * List as many devices as fit in the page, in whole lines. If some are left
+ * out, a last line says how many; each of them can still be found under
+ * /sys/kernel/rapiddisk/rdN/.
+ */
 static ssize_t devices_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-        int len = 0;
-        struct rdsk_device *rdsk;
-
-        mutex_lock(&sysfs_mutex);
-
-        len += sprintf(buf + len, "Device\tSize\tErrors\tUsed\n");
-        list_for_each_entry(rdsk, &rdsk_devices, rdsk_list) {
-                len += scnprintf(buf + len, PAGE_SIZE - len, "rd%d\t%llu\t%lu\t%llu\n", rdsk->num,
-                                 rdsk->size, rdsk->error_cnt, (rdsk->max_page_cnt * PAGE_SIZE));
-        }
+	struct rdsk_device *rdsk;
+	unsigned long num, shown = 0;
+	char line[RDSK_DEVICES_LINE];
+	int len, n;
 
-        mutex_unlock(&sysfs_mutex);
-        return len;
+	mutex_lock(&sysfs_mutex);
+	len = sprintf(buf, "Device\tSize\tErrors\tUsed\n");
+	rdsk_for_each_device(rdsk, num) {
+		n = scnprintf(line, sizeof(line), "rd%d\t%llu\t%llu\t%llu\n", rdsk->num,
+			      rdsk->size, rdsk_error_count(rdsk), (rdsk_used_pages(rdsk) * PAGE_SIZE));
+		if (len + n > PAGE_SIZE - RDSK_DEVICES_LINE)
+			break;
+		memcpy(buf + len, line, n);
+		len += n;
+		shown++;
+	}
+	if (shown < rd_total)
+		len += sprintf(buf + len, "... %lu more, see /sys/kernel/rapiddisk/rdN/size and stats\n",
+			       rd_total - shown);
+	mutex_unlock(&sysfs_mutex);
+	return len;
 }
 
 static ssize_t mgmt_store(struct kobject *kobj, struct kobj_attribute *attr,
@@ -191,10 +804,21 @@ static ssize_t mgmt_store(struct kobject *kobj, struct kobj_attribute *attr,
 		num = simple_strtoul(ptr, &ptr, 0);
 		size = (simple_strtoull(ptr + 1, &ptr, 0));
 
-		if (attach_device(num, size) != SUCCESS) {
+		if (attach_device(num, size, ptr, NULL) != SUCCESS) {
 			pr_err("%s: Unable to attach a new RapidDisk device.\n", PREFIX);
 			err = -EINVAL;
 		}
+	} else if (!strncmp("rapiddisk clone ", buffer, 16)) {
+		unsigned long src;
+
+		ptr = buf + 16;
+		src = simple_strtoul(ptr, &ptr, 0);
+		num = simple_strtoul(ptr + 1, &ptr, 0);
+
+		if (clone_device(src, num) != SUCCESS) {
+			pr_err("%s: Unable to clone rd%lu\n", PREFIX, src);
+			err = -EINVAL;
+		}
 	} else if (!strncmp("rapiddisk detach ", buffer, 17)) {
 		ptr = buf + 17;
 		num = simple_strtoul(ptr, &ptr, 0);
@@ -229,9 +853,17 @@ static struct kobj_attribute mgmt_attribute =
 static struct kobj_attribute dev_attribute =
 	__ATTR(devices, 0664, devices_show, NULL);
 
+#ifdef RDSK_ASYNC_TEARDOWN
+static struct kobj_attribute teardown_attribute =
+	__ATTR(teardown, 0444, teardown_show, NULL);
+#endif
+
 static struct attribute *attrs[] = {
 	&mgmt_attribute.attr,
 	&dev_attribute.attr,
+#ifdef RDSK_ASYNC_TEARDOWN
+	&teardown_attribute.attr,
+#endif
 	NULL,
 };
 
@@ -239,539 +871,4196 @@ static struct attribute_group attr_group = {
 	.attrs = attrs,
 };
 
-static struct page *rdsk_lookup_page(struct rdsk_device *rdsk, sector_t sector)
+static ssize_t stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-	pgoff_t idx;
-	struct page *page;
+	struct rdsk_device *rdsk = container_of(kobj, struct rdsk_device, kobj);
+	struct rdsk_stats *sum;
+	int len;
 
-	rcu_read_lock();
-	idx = sector >> PAGE_SECTORS_SHIFT; /* sector to page index */
-	page = radix_tree_lookup(&rdsk->rdsk_pages, idx);
-	rcu_read_unlock();
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	rdsk_stats_sum(rdsk, sum);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
-	BUG_ON(page && page_folio(page)->index != idx);
-#else
-	BUG_ON(page && page->index != idx);
+	len = sprintf(buf, "read_ios %llu\nread_bytes %llu\nwrite_ios %llu\nwrite_bytes %llu\n"
+		      "discard_ios %llu\ndiscard_bytes %llu\n",
+		      sum->ios[RDSK_STAT_READ], sum->bytes[RDSK_STAT_READ],
+		      sum->ios[RDSK_STAT_WRITE], sum->bytes[RDSK_STAT_WRITE],
+		      sum->ios[RDSK_STAT_DISCARD], sum->bytes[RDSK_STAT_DISCARD]);
+	len += sprintf(buf + len, "page_allocs %llu\npage_frees %llu\nalloc_failures %llu\n"
+		       "zero_pages_elided %llu\npages_used %llu\nerrors %llu\n",
+		       sum->page_allocs, sum->page_frees, sum->alloc_fails, sum->zero_elided,
+		       (unsigned long long)max_t(s64, sum->pages, 0), sum->errors);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	if (rdsk->cow)
+		len += sprintf(buf + len, "pages_shared %lu\ncow_copies %llu\n",
+			       rdsk_shared_pages(rdsk), sum->cow_copies);
+#endif
+	if (rdsk->nt_threshold)
+		len += sprintf(buf + len, "nt_threshold %u\nnt_bytes %llu\n",
+			       rdsk->nt_threshold, sum->nt_bytes);
+#ifdef RDSK_NOWAIT
+	len += sprintf(buf + len, "nowait_again %llu\n", sum->nowait_again);
+#endif
+	if (rdsk->movable)
+		len += sprintf(buf + len, "pages_migrated %llu\n", sum->migrated);
+#ifdef RDSK_RESERVE
+	if (rdsk->pool)
+		len += sprintf(buf + len, "reserve_pages %lu\npool_pages %ld\npool_allocs %llu\n",
+			       rdsk->reserve, atomic_long_read(&rdsk->pool->nr), sum->pool_allocs);
 #endif
 
-	return page;
+	kfree(sum);
+	return len;
 }
 
-static struct page *rdsk_insert_page(struct rdsk_device *rdsk, sector_t sector)
+static ssize_t latency_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-	pgoff_t idx;
-	struct page *page;
-	gfp_t gfp_flags;
+	struct rdsk_device *rdsk = container_of(kobj, struct rdsk_device, kobj);
+	struct rdsk_stats *sum;
+	int len, i;
 
-	page = rdsk_lookup_page(rdsk, sector);
-	if (page)
-		return page;
-
-	/*
-	 * Must use NOIO because we don't want to recurse back into the
-	 * block or filesystem layers from page reclaim.
-	 *
-	 * Cannot support XIP and highmem, because our ->direct_access
-	 * routine for XIP must return memory that is always addressable.
-	 * If XIP was reworked to use pfns and kmap throughout, this
-	 * restriction might be able to be lifted.
-	 */
-	gfp_flags = GFP_NOIO | __GFP_ZERO | __GFP_HIGHMEM;
-	page = alloc_page(gfp_flags);
-	if (!page)
-		return NULL;
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	rdsk_stats_sum(rdsk, sum);
 
-	if (radix_tree_preload(GFP_NOIO)) {
-		__free_page(page);
-		return NULL;
+	/* Each row counts I/Os that completed in less than "ns_lt" nanoseconds. */
+	len = sprintf(buf, "ns_lt\tread\twrite\tdiscard\n");
+	for (i = 0; i < RDSK_LAT_BUCKETS; i++) {
+		if (i == RDSK_LAT_BUCKETS - 1)
+			len += sprintf(buf + len, "inf");
+		else
+			len += sprintf(buf + len, "%llu", 1ULL << (RDSK_LAT_SHIFT + i));
+		len += sprintf(buf + len, "\t%llu\t%llu\t%llu\n", sum->lat[RDSK_STAT_READ][i],
+			       sum->lat[RDSK_STAT_WRITE][i], sum->lat[RDSK_STAT_DISCARD][i]);
 	}
 
-	spin_lock(&rdsk->rdsk_lock);
-	idx = sector >> PAGE_SECTORS_SHIFT;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
-	page_folio(page)->index = idx;
-#else
-	page->index = idx;
-#endif
-	if (radix_tree_insert(&rdsk->rdsk_pages, idx, page)) {
-		__free_page(page);
-		page = radix_tree_lookup(&rdsk->rdsk_pages, idx);
-		BUG_ON(!page);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
-		BUG_ON(page_folio(page)->index != idx);
-#else
-		BUG_ON(page->index != idx);
-#endif
+	kfree(sum);
+	return len;
+}
+
+static ssize_t numa_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct rdsk_device *rdsk = container_of(kobj, struct rdsk_device, kobj);
+	int len, nid, cpu;
+
+	switch (rdsk->numa_policy) {
+	case RDSK_NUMA_INTERLEAVE:
+		len = sprintf(buf, "policy interleave\n");
+		break;
+	case RDSK_NUMA_BIND:
+		len = sprintf(buf, "policy bind:%d\n", rdsk->numa_node);
+		break;
+	default:
+		len = sprintf(buf, "policy local\n");
+		break;
 	}
-	spin_unlock(&rdsk->rdsk_lock);
 
-	radix_tree_preload_end();
-	rdsk->max_page_cnt++;
+	/* Pages in use per node. */
+	for_each_node_state(nid, N_MEMORY) {
+		long pages = 0;
 
-	return page;
+		for_each_possible_cpu(cpu)
+			pages += per_cpu_ptr(rdsk->node_pages, cpu)[nid];
+		len += scnprintf(buf + len, PAGE_SIZE - len, "node%d %ld\n", nid, max(pages, 0L));
+	}
+
+	return len;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
-static void rdsk_zero_page(struct rdsk_device *rdsk, sector_t sector)
+static ssize_t compression_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-	struct page *page;
+#ifdef RDSK_COMPRESS
+	struct rdsk_device *rdsk = container_of(kobj, struct rdsk_device, kobj);
+	struct rdsk_comp *comp = rdsk->comp;
 
-	page = rdsk_lookup_page(rdsk, sector);
-	if (page) {
-		clear_highpage(page);
-		rdsk->max_page_cnt--;
+	if (comp) {
+		u64 logical = rdsk_page_count(rdsk) << PAGE_SHIFT;
+		u64 pool = (u64)zs_get_total_pages(comp->pool) << PAGE_SHIFT;
+		u64 ratio = pool ? div64_u64(logical * 100, pool) : 0;
+
+		/* ratio: logical bytes stored per byte of pool memory */
+		return sprintf(buf, "algorithm %s\nlogical_bytes %llu\ncompressed_bytes %llu\n"
+			       "pool_bytes %llu\nratio %llu.%02llu\n",
+			       comp->algo == RDSK_COMP_ZSTD ? "zstd" : "lz4", logical,
+			       (u64)atomic64_read(&comp->stored), pool, ratio / 100, ratio % 100);
 	}
-}
 #endif
+	return sprintf(buf, "algorithm none\n");
+}
 
-static void rdsk_free_pages(struct rdsk_device *rdsk)
+static ssize_t mirror_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
 {
-	unsigned long pos = 0;
-	struct page *pages[FREE_BATCH];
-	int nr_pages;
+#ifdef RDSK_MIRROR
+	struct rdsk_device *rdsk = container_of(kobj, struct rdsk_device, kobj);
+	struct rdsk_mirror *m = rdsk->mirror;
 
-	do {
-		int i;
+	/* lag_ms: every write older than this has reached the file. */
+	if (m)
+		return scnprintf(buf, PAGE_SIZE, "path %s\ndirty_pages %lu\nlag_ms %u\n"
+				 "bytes_written %llu\nerrors %lu\nrate_limit_mbs %u\n",
+				 m->path, (unsigned long)bitmap_weight(m->dirty, m->nr_pages),
+				 jiffies_to_msecs(jiffies - READ_ONCE(m->synced)),
+				 m->bytes_written, m->errors, m->rate);
+#endif
+	return sprintf(buf, "path none\n");
+}
 
-		nr_pages = radix_tree_gang_lookup(&rdsk->rdsk_pages,
-						  (void **)pages, pos,
-						  FREE_BATCH);
+/*
+ * Usage watermarks, in percent of the device size. Whenever the usage
+ * crosses one of them, usage_level (the number of watermarks reached)
+ * changes, pollers of usage_level are woken up and a change uevent with
+ * RAPIDDISK_USAGE_LEVEL is sent for the disk.
+ */
+static void rdsk_wm_fn(struct work_struct *work)
+{
+	struct rdsk_device *rdsk = container_of(to_delayed_work(work), struct rdsk_device, wm_work);
+	char env[32], *envp[] = { env, NULL };
+	unsigned int level = 0;
+	u64 pct;
 
-		for (i = 0; i < nr_pages; i++) {
-			void *ret;
+	mutex_lock(&rdsk->wm_lock);
+	if (rdsk->wm_gone)
+		goto out;
+	pct = div64_u64(rdsk_used_pages(rdsk) * PAGE_SIZE * 100, rdsk->size);
+	while (level < rdsk->wm_nr && pct >= rdsk->wm[level])
+		level++;
+	if (level == rdsk->wm_level)
+		goto out;
+	WRITE_ONCE(rdsk->wm_level, level);
+	sysfs_notify(&rdsk->kobj, NULL, "usage_level");
+	snprintf(env, sizeof(env), "RAPIDDISK_USAGE_LEVEL=%u", level);
+	kobject_uevent_env(&disk_to_dev(rdsk->rdsk_disk)->kobj, KOBJ_CHANGE, envp);
+out:
+	mutex_unlock(&rdsk->wm_lock);
+}
+
+static ssize_t watermarks_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct rdsk_device *rdsk = container_of(kobj, struct rdsk_device, kobj);
+	int len = 0;
+	unsigned int i;
+
+	mutex_lock(&rdsk->wm_lock);
+	for (i = 0; i < rdsk->wm_nr; i++)
+		len += sprintf(buf + len, "%s%u", i ? " " : "", rdsk->wm[i]);
+	mutex_unlock(&rdsk->wm_lock);
+	len += sprintf(buf + len, "\n");
+	return len;
+}
+
+/* Up to RDSK_WATERMARKS ascending percentages; "0" or an empty line disables them. */
+static ssize_t watermarks_store(struct kobject *kobj, struct kobj_attribute *attr,
+				const char *buffer, size_t count)
+{
+	struct rdsk_device *rdsk = container_of(kobj, struct rdsk_device, kobj);
+	unsigned int wm[RDSK_WATERMARKS], nr = 0, val;
+	bool clear = false;
+	char *buf, *p, *tok;
+
+	buf = kstrndup(buffer, count, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	/* Ascending percentages, or a lone 0 to remove them; anything else is refused. */
+	p = buf;
+	while ((tok = strsep(&p, " \t\n")) != NULL) {
+		if (!*tok)
+			continue;
+		if (clear || kstrtouint(tok, 10, &val) || val > 100 || (!val && nr) ||
+		    (val && (nr == RDSK_WATERMARKS || (nr && val <= wm[nr - 1])))) {
+			kfree(buf);
+			return -EINVAL;
+		}
+		if (!val)
+			clear = true;
+		else
+			wm[nr++] = val;
+	}
+	kfree(buf);
+	if (!nr && !clear)
+		return -EINVAL;
+
+	mutex_lock(&rdsk->wm_lock);
+	if (rdsk->wm_gone) {
+		mutex_unlock(&rdsk->wm_lock);
+		return -ENODEV;
+	}
+	memcpy(rdsk->wm, wm, nr * sizeof(wm[0]));
+	WRITE_ONCE(rdsk->wm_nr, nr);
+	/* Report where the usage stands against the new watermarks right away. */
+	mod_delayed_work(rdsk_wq, &rdsk->wm_work, 0);
+	mutex_unlock(&rdsk->wm_lock);
+	return count;
+}
+
+static ssize_t usage_level_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct rdsk_device *rdsk = container_of(kobj, struct rdsk_device, kobj);
+
+	return sprintf(buf, "%u\n", READ_ONCE(rdsk->wm_level));
+}
+
+static ssize_t size_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	struct rdsk_device *rdsk = container_of(kobj, struct rdsk_device, kobj);
+
+	return sprintf(buf, "%llu\n", READ_ONCE(rdsk->size));
+}
+
+static struct kobj_attribute rdsk_size_attribute =
+	__ATTR(size, 0444, size_show, NULL);
+
+static struct kobj_attribute rdsk_stats_attribute =
+	__ATTR(stats, 0444, stats_show, NULL);
 
+static struct kobj_attribute rdsk_latency_attribute =
+	__ATTR(latency, 0444, latency_show, NULL);
+
+static struct kobj_attribute rdsk_numa_attribute =
+	__ATTR(numa, 0444, numa_show, NULL);
+
+static struct kobj_attribute rdsk_compression_attribute =
+	__ATTR(compression, 0444, compression_show, NULL);
+
+static struct kobj_attribute rdsk_mirror_attribute =
+	__ATTR(mirror, 0444, mirror_show, NULL);
+
+static struct kobj_attribute rdsk_watermarks_attribute =
+	__ATTR(watermarks, 0644, watermarks_show, watermarks_store);
+
+static struct kobj_attribute rdsk_usage_level_attribute =
+	__ATTR(usage_level, 0444, usage_level_show, NULL);
+
+static struct attribute *rdsk_attrs[] = {
+	&rdsk_size_attribute.attr,
+	&rdsk_stats_attribute.attr,
+	&rdsk_numa_attribute.attr,
+	&rdsk_compression_attribute.attr,
+	&rdsk_latency_attribute.attr,
+	&rdsk_mirror_attribute.attr,
+	&rdsk_watermarks_attribute.attr,
+	&rdsk_usage_level_attribute.attr,
+	NULL,
+};
+
+static struct attribute_group rdsk_attr_group = {
+	.attrs = rdsk_attrs,
+};
+
+#ifdef RDSK_COMPRESS
+static void rdsk_comp_destroy(struct rdsk_comp *);
+#endif
+#ifdef RDSK_MIRROR
+static void rdsk_mirror_destroy(struct rdsk_mirror *);
+#endif
+#ifdef RDSK_RESERVE
+static void rdsk_pool_destroy(struct rdsk_pool *);
+#endif
+
+static void rdsk_kobj_release(struct kobject *kobj)
+{
+	struct rdsk_device *rdsk = container_of(kobj, struct rdsk_device, kobj);
+
+#ifdef RDSK_COMPRESS
+	rdsk_comp_destroy(rdsk->comp);
+#endif
+#ifdef RDSK_MIRROR
+	rdsk_mirror_destroy(rdsk->mirror);
+#endif
+#ifdef RDSK_ZONED
+	kvfree(rdsk->zoned);
+#endif
+#ifdef RDSK_RESERVE
+	rdsk_pool_destroy(rdsk->pool);
+#endif
+	kfree(rdsk->rdsk_shards);
+	free_percpu(rdsk->node_pages);
+	free_percpu(rdsk->stats);
+	kfree(rdsk);
+}
+
+static struct kobj_type rdsk_ktype = {
+	.sysfs_ops = &kobj_sysfs_ops,
+	.release = rdsk_kobj_release,
+};
+
+static inline pgoff_t rdsk_page_index(struct page *page)
+{
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
-			BUG_ON(page_folio(pages[i])->index < pos);
-			pos = page_folio(pages[i])->index;
+	return page_folio(page)->index;
 #else
-			BUG_ON(pages[i]->index < pos);
-			pos = pages[i]->index;
+	return page->index;
 #endif
-			ret = radix_tree_delete(&rdsk->rdsk_pages, pos);
-			BUG_ON(!ret || ret != pages[i]);
-			__free_page(pages[i]);
+}
+
+static inline void rdsk_set_page_index(struct page *page, pgoff_t idx)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
+	page_folio(page)->index = idx;
+#else
+	page->index = idx;
+#endif
+}
+
+static inline struct rdsk_shard *rdsk_shard(struct rdsk_device *rdsk, pgoff_t idx)
+{
+	return &rdsk->rdsk_shards[(idx >> RDSK_SHARD_SHIFT) & (RDSK_SHARDS - 1)];
+}
+
+static struct rdsk_shard *rdsk_alloc_shards(void)
+{
+	struct rdsk_shard *shards;
+	int i;
+
+	shards = kcalloc(RDSK_SHARDS, sizeof(*shards), GFP_KERNEL);
+	if (!shards)
+		return NULL;
+	for (i = 0; i < RDSK_SHARDS; i++) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+		xa_init(&shards[i].pages);
+#ifdef RDSK_MOVABLE
+		rwlock_init(&shards[i].mig_lock);
+#endif
+#else
+		spin_lock_init(&shards[i].lock);
+		INIT_RADIX_TREE(&shards[i].pages, GFP_ATOMIC);
+#endif
+	}
+	return shards;
+}
+
+static inline void rdsk_free_page(struct page *page)
+{
+	__free_pages(page, compound_order(page));
+}
+
+#ifdef RDSK_MIRROR
+/* Mark the pages behind n bytes at sector for the mirror thread, once they are written. */
+static void rdsk_mirror_dirty(struct rdsk_device *rdsk, sector_t sector, size_t n)
+{
+	struct rdsk_mirror *m = rdsk->mirror;
+	pgoff_t idx, last;
+
+	if (!m || !n)
+		return;
+	/* Order the data before the bit tests; pairs with test_and_clear_bit() in the pass. */
+	smp_mb();
+	last = (sector + (n >> SECTOR_SHIFT) - 1) >> PAGE_SECTORS_SHIFT;
+	for (idx = sector >> PAGE_SECTORS_SHIFT; idx <= last; idx++) {
+		/* Test first so that rewrites of a dirty page do not bounce its cache line. */
+		if (!test_bit(idx, m->dirty)) {
+			set_bit(idx, m->dirty);
+			smp_mb__after_atomic();
 		}
-		pos++;
-	} while (nr_pages == FREE_BATCH);
+		if (!test_bit(idx >> RDSK_SHARD_SHIFT, m->dirty_chunks))
+			set_bit(idx >> RDSK_SHARD_SHIFT, m->dirty_chunks);
+	}
+}
+#endif
+
+/* Pick the node that backs page index idx, or NUMA_NO_NODE for the local one. */
+static int rdsk_page_node(struct rdsk_device *rdsk, pgoff_t idx)
+{
+	int nid, n;
+
+	switch (rdsk->numa_policy) {
+	case RDSK_NUMA_BIND:
+		return rdsk->numa_node;
+	case RDSK_NUMA_INTERLEAVE:
+		/* Keep large folio chunks whole; they are the unit of placement. */
+		n = (idx >> rdsk->page_order) % num_node_state(N_MEMORY);
+		for_each_node_state(nid, N_MEMORY)
+			if (!n--)
+				return nid;
+		return NUMA_NO_NODE;
+	default:
+		return NUMA_NO_NODE;
+	}
+}
+
+static struct page *__rdsk_alloc_pages(struct rdsk_device *rdsk, pgoff_t idx,
+				       gfp_t gfp, unsigned int order)
+{
+	int nid = rdsk_page_node(rdsk, idx);
+
+	if (nid == NUMA_NO_NODE)
+		return alloc_pages(gfp, order);
+	if (rdsk->numa_policy == RDSK_NUMA_BIND)
+		gfp |= __GFP_THISNODE;
+	return alloc_pages_node(nid, gfp, order);
+}
+
+#ifdef RDSK_RESERVE
+/*
+ * Take a page from the pool, zeroed if gfp asks for it, or NULL if the pool
+ * is empty. The local cache is tried first, then the shared list, and only
+ * then the caches of the other CPUs. The cache pointer is not pinned; the
+ * locks keep it consistent if we migrate.
+ */
+static struct page *rdsk_pool_get(struct rdsk_pool *pool, gfp_t gfp)
+{
+	struct page *page = NULL;
+	struct rdsk_pcp *pcp;
+	unsigned long flags;
+	int cpu;
+
+	if (!atomic_long_read(&pool->nr))
+		return NULL;
+
+	pcp = raw_cpu_ptr(pool->pcp);
+	spin_lock_irqsave(&pcp->lock, flags);
+	if (pcp->nr)
+		page = pcp->pages[--pcp->nr];
+	spin_unlock_irqrestore(&pcp->lock, flags);
+
+	if (!page) {
+		spin_lock_irqsave(&pool->lock, flags);
+		page = list_first_entry_or_null(&pool->free, struct page, lru);
+		if (page)
+			list_del(&page->lru);
+		spin_unlock_irqrestore(&pool->lock, flags);
+	}
+
+	if (!page) {
+		for_each_possible_cpu(cpu) {
+			pcp = per_cpu_ptr(pool->pcp, cpu);
+			spin_lock_irqsave(&pcp->lock, flags);
+			if (pcp->nr)
+				page = pcp->pages[--pcp->nr];
+			spin_unlock_irqrestore(&pcp->lock, flags);
+			if (page)
+				break;
+		}
+		if (!page)
+			return NULL;
+	}
+
+	atomic_long_dec(&pool->nr);
+	if (gfp & __GFP_ZERO)
+		clear_highpage(page);
+	return page;
+}
+
+/*
+ * Recycle a page the device no longer indexes, or return it to the system
+ * once the pool holds the whole reservation. This runs from RCU callbacks,
+ * hence the irqsave locks. Pages someone else still holds a reference on
+ * and large folios always go back to the system.
+ */
+static void rdsk_pool_put(struct rdsk_pool *pool, struct page *page)
+{
+	struct rdsk_pcp *pcp;
+	unsigned long flags;
+
+	if (!pool || PageCompound(page) || page_ref_count(page) != 1 ||
+	    atomic_long_read(&pool->nr) >= pool->reserve) {
+		rdsk_free_page(page);
+		return;
+	}
+	atomic_long_inc(&pool->nr);
+
+	pcp = raw_cpu_ptr(pool->pcp);
+	spin_lock_irqsave(&pcp->lock, flags);
+	if (pcp->nr < RDSK_PCP_PAGES) {
+		pcp->pages[pcp->nr++] = page;
+		page = NULL;
+	}
+	spin_unlock_irqrestore(&pcp->lock, flags);
+	if (!page)
+		return;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	list_add(&page->lru, &pool->free);
+	spin_unlock_irqrestore(&pool->lock, flags);
+}
+
+/*
+ * Top the pool up until the pages in use and the pages held cover the
+ * reservation again, i.e. at attach and after a flush emptied the device.
+ * The pages are placed by the NUMA policy as if they backed the first
+ * indexes of the device.
+ */
+static int rdsk_pool_fill(struct rdsk_device *rdsk, gfp_t gfp)
+{
+	struct rdsk_pool *pool = rdsk->pool;
+	unsigned long long used = rdsk_page_count(rdsk);
+	struct page *page;
+	pgoff_t idx = 0;
+
+	gfp |= __GFP_NORETRY | __GFP_NOWARN | __GFP_HIGHMEM;
+	while (used + atomic_long_read(&pool->nr) < pool->reserve) {
+		page = __rdsk_alloc_pages(rdsk, idx++, gfp, 0);
+		if (!page)
+			return -ENOMEM;
+		rdsk_pool_put(pool, page);
+		cond_resched();
+	}
+	return SUCCESS;
+}
+
+static int rdsk_pool_init(struct rdsk_device *rdsk)
+{
+	struct rdsk_pool *pool;
+	int cpu;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return -ENOMEM;
+	pool->pcp = alloc_percpu(struct rdsk_pcp);
+	if (!pool->pcp) {
+		kfree(pool);
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(pool->pcp, cpu)->lock);
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->free);
+	pool->reserve = rdsk->reserve;
+	/* Released with the device from here on. */
+	rdsk->pool = pool;
+
+	if (rdsk_pool_fill(rdsk, GFP_KERNEL) != SUCCESS) {
+		pr_err("%s: Unable to reserve %lu pages for rd%d.\n", PREFIX, pool->reserve,
+		       rdsk->num);
+		return -ENOMEM;
+	}
+	return SUCCESS;
+}
+
+static void rdsk_pool_destroy(struct rdsk_pool *pool)
+{
+	struct page *page, *next;
+	unsigned int i;
+	int cpu;
+
+	if (!pool)
+		return;
+	/* Batches queued by the device may still hand pages back. */
+	rcu_barrier();
+	for_each_possible_cpu(cpu) {
+		struct rdsk_pcp *pcp = per_cpu_ptr(pool->pcp, cpu);
+
+		for (i = 0; i < pcp->nr; i++)
+			__free_page(pcp->pages[i]);
+	}
+	list_for_each_entry_safe(page, next, &pool->free, lru)
+		__free_page(page);
+	free_percpu(pool->pcp);
+	kfree(pool);
+}
+#endif
+
+/* Reserved pages come from the pool first; everything else from the page allocator. */
+static struct page *rdsk_alloc_pages(struct rdsk_device *rdsk, pgoff_t idx,
+				     gfp_t gfp, unsigned int order)
+{
+#ifdef RDSK_RESERVE
+	struct page *page;
+
+	if (rdsk->pool && !order) {
+		page = rdsk_pool_get(rdsk->pool, gfp);
+		if (page) {
+			this_cpu_inc(rdsk->stats->pool_allocs);
+			return page;
+		}
+	}
+#endif
+	return __rdsk_alloc_pages(rdsk, idx, gfp, order);
+}
+
+static inline bool rdsk_has_pool(struct rdsk_device *rdsk)
+{
+#ifdef RDSK_RESERVE
+	return rdsk->pool != NULL;
+#else
+	return false;
+#endif
+}
+
+/* Give back a page that was allocated but never made it into the index. */
+static inline void rdsk_free_new_page(struct rdsk_device *rdsk, struct page *page)
+{
+#ifdef RDSK_RESERVE
+	rdsk_pool_put(rdsk->pool, page);
+#else
+	__free_page(page);
+#endif
+}
+
+static struct page *rdsk_lookup_page(struct rdsk_device *rdsk, sector_t sector)
+{
+	pgoff_t idx;
+	struct page *page;
+
+	idx = sector >> PAGE_SECTORS_SHIFT; /* sector to page index */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	page = xa_load(&rdsk_shard(rdsk, idx)->pages, idx);
+#else
+	rcu_read_lock();
+	page = radix_tree_lookup(&rdsk_shard(rdsk, idx)->pages, idx);
+	rcu_read_unlock();
+#endif
+
+#ifdef RDSK_LARGE_FOLIOS
+	/* A large folio is indexed once and covers every index in its range. */
+	if (page && PageCompound(page)) {
+		pgoff_t first = rdsk_page_index(page);
+
+		BUG_ON(idx < first || idx >= first + compound_nr(page));
+		return folio_page(page_folio(page), idx - first);
+	}
+#endif
+	BUG_ON(page && rdsk_page_index(page) != idx);
+
+	return page;
+}
+
+#ifdef RDSK_LARGE_FOLIOS
+/*
+ * Install a large folio covering [idx, idx + (1 << order)) unless any part
+ * of that range is already populated. Returns NULL if the folio was stored,
+ * the conflicting entry if there was one, or an ERR_PTR on failure.
+ */
+static struct page *rdsk_store_large_page(struct rdsk_shard *shard, pgoff_t idx,
+					  struct page *page, unsigned int order, gfp_t gfp)
+{
+	XA_STATE_ORDER(xas, &shard->pages, idx, order);
+	void *cur;
+
+	do {
+		xas_lock(&xas);
+		cur = xas_find_conflict(&xas);
+		if (!cur)
+			xas_store(&xas, page);
+		xas_unlock(&xas);
+	} while (xas_nomem(&xas, gfp));
+
+	if (xas_error(&xas))
+		return ERR_PTR(xas_error(&xas));
+	return cur;
+}
+
+/*
+ * Back the chunk containing sector with a single large folio. Returns NULL
+ * if the allocation failed or the chunk is partially populated already, in
+ * which case the caller falls back to order-0 pages.
+ */
+static struct page *rdsk_insert_large_page(struct rdsk_device *rdsk, sector_t sector,
+					   gfp_t gfp)
+{
+	unsigned int order = rdsk->page_order;
+	pgoff_t idx, first;
+	struct page *page, *cur;
+
+	idx = sector >> PAGE_SECTORS_SHIFT;
+	first = idx & ~((1UL << order) - 1);
+
+	/* Do not try hard; fragmentation is handled by falling back to small pages. */
+	page = rdsk_alloc_pages(rdsk, first, gfp | __GFP_ZERO | __GFP_COMP | __GFP_NOWARN |
+				__GFP_NORETRY, order);
+	if (!page)
+		return NULL;
+	rdsk_set_page_index(page, first);
+
+	cur = rdsk_store_large_page(rdsk_shard(rdsk, first), first, page, order, gfp);
+	if (cur) {
+		__free_pages(page, order);
+		return rdsk_lookup_page(rdsk, sector);
+	}
+	rdsk_count_pages(rdsk, 1 << order);
+	rdsk_count_node(rdsk, page, 1 << order);
+
+	return folio_page(page_folio(page), idx - first);
+}
+#endif
+
+#ifdef RDSK_MOVABLE
+/*
+ * Pages of a movable device carry rdsk_movable_ops, so that compaction can
+ * move them out of the way. A page is marked once it is in the index, and
+ * unmarked under its lock before the device drops it; a marked page thus
+ * always belongs to a live device, which page->private points to. Readers
+ * and writers copy page contents while holding the shard's mig_lock for
+ * reading, which migration takes for writing while it copies the page and
+ * swaps it in the index.
+ */
+static const struct movable_operations rdsk_movable_ops;
+
+/*
+ * Only pages still in the index of a device that is not being detached are
+ * handed to compaction. The page lock held by the caller keeps the device
+ * around, see rdsk_unmark_movable().
+ */
+static bool rdsk_isolate_page(struct page *page, isolate_mode_t mode)
+{
+	struct rdsk_device *rdsk = (struct rdsk_device *)page_private(page);
+	pgoff_t idx = rdsk_page_index(page);
+	struct rdsk_shard *shard;
+	bool indexed;
+
+	if (READ_ONCE(rdsk->mig_gone))
+		return false;
+	shard = rdsk_shard(rdsk, idx);
+	read_lock(&shard->mig_lock);
+	indexed = xa_load(&shard->pages, idx) == page;
+	read_unlock(&shard->mig_lock);
+	return indexed;
+}
+
+static int rdsk_migrate_page(struct page *dst, struct page *src, enum migrate_mode mode)
+{
+	struct rdsk_device *rdsk = (struct rdsk_device *)page_private(src);
+	pgoff_t idx = rdsk_page_index(src);
+	struct rdsk_shard *shard = rdsk_shard(rdsk, idx);
+
+	/* Compaction retries later; never stall I/O on the shard. */
+	if (!write_trylock(&shard->mig_lock))
+		return -EAGAIN;
+	/* Discarded meanwhile; the page is on its way out. */
+	if (READ_ONCE(rdsk->mig_gone) || xa_load(&shard->pages, idx) != src)
+		goto out_busy;
+
+	copy_highpage(dst, src);
+	rdsk_set_page_index(dst, idx);
+	set_page_private(dst, (unsigned long)rdsk);
+	if (xa_cmpxchg(&shard->pages, idx, src, dst, GFP_NOWAIT) != src)
+		goto out_busy;
+	get_page(dst);
+	__SetPageMovable(dst, &rdsk_movable_ops);
+	write_unlock(&shard->mig_lock);
+
+	rdsk_count_node(rdsk, src, -1);
+	rdsk_count_node(rdsk, dst, 1);
+	this_cpu_inc(rdsk->stats->migrated);
+	/* Drop the reference of the index; compaction frees the page. */
+	__ClearPageMovable(src);
+	put_page(src);
+	return MIGRATEPAGE_SUCCESS;
+
+out_busy:
+	write_unlock(&shard->mig_lock);
+	return -EAGAIN;
+}
+
+static void rdsk_putback_page(struct page *page)
+{
+}
+
+static const struct movable_operations rdsk_movable_ops = {
+	.isolate_page = rdsk_isolate_page,
+	.migrate_page = rdsk_migrate_page,
+	.putback_page = rdsk_putback_page,
+};
+
+/*
+ * Mark a page that was just installed at its index. Called under the
+ * XArray lock, so that a discard cannot unlink it before it is marked.
+ * Nobody else locks a fresh page, but if somebody does, it simply stays
+ * where it is.
+ */
+static void rdsk_mark_movable(struct rdsk_device *rdsk, struct page *page)
+{
+	if (!rdsk->movable || !trylock_page(page))
+		return;
+	set_page_private(page, (unsigned long)rdsk);
+	__SetPageMovable(page, &rdsk_movable_ops);
+	unlock_page(page);
+}
+
+/*
+ * Unmark pages unlinked from the index before they are freed. The page
+ * lock waits out a migration in progress, which then finds the page gone.
+ */
+static void rdsk_unmark_movable(struct rdsk_device *rdsk, struct page **pages, unsigned int nr)
+{
+	unsigned int i;
+
+	if (!rdsk->movable)
+		return;
+	for (i = 0; i < nr; i++) {
+		lock_page(pages[i]);
+		if (PageMovable(pages[i]))
+			__ClearPageMovable(pages[i]);
+		unlock_page(pages[i]);
+	}
+}
+#else
+static inline void rdsk_mark_movable(struct rdsk_device *rdsk, struct page *page)
+{
+}
+
+static inline void rdsk_unmark_movable(struct rdsk_device *rdsk, struct page **pages,
+				       unsigned int nr)
+{
 }
+#endif
+
+static struct page *rdsk_insert_page(struct rdsk_device *rdsk, sector_t sector,
+				     gfp_t gfp)
+{
+	pgoff_t idx;
+	struct page *page, *cur;
+	struct rdsk_shard *shard;
+	gfp_t gfp_flags;
+
+	page = rdsk_lookup_page(rdsk, sector);
+	if (page)
+		return page;
+
+#ifdef RDSK_LARGE_FOLIOS
+	if (rdsk->page_order) {
+		page = rdsk_insert_large_page(rdsk, sector, gfp);
+		if (page)
+			return page;
+	}
+#endif
+
+	/*
+	 * Callers pass NOIO (or NOWAIT) because we don't want to recurse back
+	 * into the block or filesystem layers from page reclaim.
+	 */
+	idx = sector >> PAGE_SECTORS_SHIFT;
+	gfp_flags = gfp | __GFP_ZERO | __GFP_HIGHMEM;
+	if (rdsk->movable)
+		gfp_flags |= __GFP_MOVABLE;
+	page = rdsk_alloc_pages(rdsk, idx, gfp_flags, 0);
+	if (!page) {
+		rdsk_count_alloc_fail(rdsk, idx);
+		return NULL;
+	}
+
+	shard = rdsk_shard(rdsk, idx);
+	rdsk_set_page_index(page, idx);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	/* Only install the page if nobody beat us to this index. */
+	cur = xa_cmpxchg(&shard->pages, idx, NULL, page, gfp);
+	if (unlikely(cur)) {
+		rdsk_free_new_page(rdsk, page);
+		if (xa_is_err(cur)) {
+			rdsk_count_alloc_fail(rdsk, idx);
+			return NULL;
+		}
+		/* May be covered by a large folio, so resolve the subpage. */
+		return rdsk_lookup_page(rdsk, sector);
+	}
+	if (rdsk->movable) {
+		xa_lock(&shard->pages);
+		if (xa_load(&shard->pages, idx) == page)
+			rdsk_mark_movable(rdsk, page);
+		xa_unlock(&shard->pages);
+	}
+#else
+	if (radix_tree_preload(gfp)) {
+		rdsk_free_new_page(rdsk, page);
+		rdsk_count_alloc_fail(rdsk, idx);
+		return NULL;
+	}
+
+	spin_lock(&shard->lock);
+	if (radix_tree_insert(&shard->pages, idx, page)) {
+		rdsk_free_new_page(rdsk, page);
+		cur = radix_tree_lookup(&shard->pages, idx);
+		BUG_ON(!cur);
+		BUG_ON(rdsk_page_index(cur) != idx);
+		spin_unlock(&shard->lock);
+		radix_tree_preload_end();
+		return cur;
+	}
+	spin_unlock(&shard->lock);
+
+	radix_tree_preload_end();
+#endif
+	rdsk_count_pages(rdsk, 1);
+	rdsk_count_node(rdsk, page, 1);
+
+	return page;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+static void rdsk_free_page_rcu(struct rcu_head *head)
+{
+	rdsk_free_page(container_of(head, struct page, rcu_head));
+}
+
+/* Pages unlinked from the index, freed together after one grace period. */
+struct rdsk_free_batch {
+	struct rcu_head rcu;
+#ifdef RDSK_RESERVE
+	struct rdsk_pool *pool;		/* recycle into this pool, if any */
+#endif
+	unsigned int nr;
+	struct page *pages[];
+};
+
+/* Pages per deferred free batch, so that a full batch fits in kmalloc-512. */
+#define RDSK_RCU_BATCH \
+	((unsigned int)((RDSK_RCU_BATCH_SIZE - offsetof(struct rdsk_free_batch, pages)) / \
+			sizeof(struct page *)))
+
+static inline struct rdsk_free_batch *rdsk_alloc_free_batch(struct rdsk_device *rdsk,
+							    unsigned int nr, gfp_t gfp)
+{
+	struct rdsk_free_batch *batch;
+
+	BUILD_BUG_ON(offsetof(struct rdsk_free_batch, pages) +
+		     RDSK_RCU_BATCH * sizeof(struct page *) > RDSK_RCU_BATCH_SIZE);
+	batch = kmalloc(offsetof(struct rdsk_free_batch, pages) + nr * sizeof(struct page *), gfp);
+	if (batch) {
+#ifdef RDSK_RESERVE
+		batch->pool = rdsk->pool;
+#endif
+		batch->nr = 0;
+	}
+	return batch;
+}
+
+static void rdsk_free_batch_rcu(struct rcu_head *head)
+{
+	struct rdsk_free_batch *batch = container_of(head, struct rdsk_free_batch, rcu);
+	unsigned int i;
+
+	for (i = 0; i < batch->nr; i++)
+#ifdef RDSK_RESERVE
+		rdsk_pool_put(batch->pool, batch->pages[i]);
+#else
+		rdsk_free_page(batch->pages[i]);
+#endif
+	kfree(batch);
+}
+
+static inline bool rdsk_mem_mapped(struct rdsk_device *rdsk)
+{
+#ifdef RDSK_MEMDEV
+	return atomic_read(&rdsk->mem_maps) > 0;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Zero page elision, discard and write zeroes drop backing pages while the
+ * device is in use, since reads of a hole return zeros anyway. Devices that
+ * promise never to allocate in the I/O path keep their pages, and so do
+ * devices mapped through /dev/rdN_mem, whose pages may be mapped into user
+ * space.
+ */
+static inline bool rdsk_can_free_pages(struct rdsk_device *rdsk)
+{
+	return !rdsk->prealloc && !rdsk_mem_mapped(rdsk);
+}
+
+/*
+ * Drop a single page for zero page elision. Large folios are left alone;
+ * the caller then stores the zeros as usual. The page is freed after an
+ * RCU grace period, as lookups and copies may still be using it. Pages of
+ * a clone may be shared, and two devices must not both queue the same
+ * page->rcu_head, so those go through a separate holder instead. So do
+ * pages of a device with a reserve pool, which the holder returns them to.
+ */
+static bool rdsk_erase_page(struct rdsk_device *rdsk, sector_t sector, gfp_t gfp)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	struct rdsk_shard *shard = rdsk_shard(rdsk, idx);
+	struct rdsk_free_batch *holder = NULL;
+	struct page *page;
+
+	page = xa_load(&shard->pages, idx);
+	if (!page)
+		return true;
+	/* Unmarking a movable page may sleep; store the zeros instead. */
+	if (PageCompound(page) || rdsk->movable)
+		return false;
+	if (rdsk->cow || rdsk_has_pool(rdsk)) {
+		holder = rdsk_alloc_free_batch(rdsk, 1, gfp | __GFP_NOWARN);
+		if (!holder)
+			return false;
+	}
+	/* Lost a race with another eraser; the page is theirs to free. */
+	if (xa_cmpxchg(&shard->pages, idx, page, NULL, 0) != page) {
+		kfree(holder);
+		return true;
+	}
+
+	rdsk_count_frees(rdsk, 1);
+	rdsk_count_node(rdsk, page, -1);
+	if (holder) {
+		holder->pages[holder->nr++] = page;
+		call_rcu(&holder->rcu, rdsk_free_batch_rcu);
+	} else {
+		call_rcu(&page->rcu_head, rdsk_free_page_rcu);
+	}
+	return true;
+}
+
+/*
+ * Unlink every backing allocation that lies entirely within page indexes
+ * [first, last]. The index is walked one shard stripe at a time under a
+ * single lock acquisition, and the pages are handed to RCU in batches.
+ * A full batch ends the walk early so that the next one can be allocated
+ * without holding the lock. Large folios that only partly overlap the
+ * range are zeroed in place.
+ */
+static void rdsk_discard_pages(struct rdsk_device *rdsk, pgoff_t first, pgoff_t last)
+{
+	struct rdsk_free_batch *batch = NULL;
+	unsigned long freed = 0;
+	pgoff_t idx = first;
+
+	while (idx <= last) {
+		pgoff_t stripe_last = min(last, idx | ((1UL << RDSK_SHARD_SHIFT) - 1));
+		XA_STATE(xas, &rdsk_shard(rdsk, idx)->pages, idx);
+		struct page *page;
+
+		if (!batch)
+			batch = rdsk_alloc_free_batch(rdsk, RDSK_RCU_BATCH, GFP_NOIO | __GFP_NOFAIL);
+
+		xas_lock(&xas);
+		xas_for_each(&xas, page, stripe_last) {
+			pgoff_t start = rdsk_page_index(page);
+			unsigned long nr = 1UL << compound_order(page);
+
+			if (start < first || start + nr - 1 > last) {
+				pgoff_t i, from = max(start, first), to = min(start + nr - 1, last);
+
+				for (i = from; i <= to; i++)
+					clear_highpage(page + (i - start));
+				continue;
+			}
+			xas_store(&xas, NULL);
+			rdsk_count_node(rdsk, page, -nr);
+			batch->pages[batch->nr++] = page;
+			freed += nr;
+			if (batch->nr == RDSK_RCU_BATCH) {
+				xas_pause(&xas);
+				break;
+			}
+		}
+		xas_unlock(&xas);
+
+		if (batch->nr == RDSK_RCU_BATCH) {
+			rdsk_unmark_movable(rdsk, batch->pages, batch->nr);
+			call_rcu(&batch->rcu, rdsk_free_batch_rcu);
+			batch = NULL;
+			/* Resume right after the last entry taken. */
+			idx = xas.xa_index;
+		} else {
+			idx = stripe_last + 1;
+		}
+		if (!idx)
+			break;
+		cond_resched();
+	}
+
+	if (batch && batch->nr) {
+		rdsk_unmark_movable(rdsk, batch->pages, batch->nr);
+		call_rcu(&batch->rcu, rdsk_free_batch_rcu);
+	} else {
+		kfree(batch);
+	}
+	rdsk_count_frees(rdsk, freed);
+}
+
+/*
+ * Clones share pages with their source, each device holding one reference
+ * on every page in its index. A page is written in place only while this
+ * device holds the only reference; otherwise it is first replaced by a
+ * private copy. References are only added while the source is frozen, and
+ * a device drops its own only an RCU grace period after the page left its
+ * index, so a writer that sees a page unshared has the next lookup find
+ * the page it may write to.
+ */
+static inline bool rdsk_page_shared(struct page *page)
+{
+	return page_ref_count(page) > 1;
+}
+
+/*
+ * Replace the shared page at sector with a private copy. Returns the copy,
+ * NULL if out of memory, or ERR_PTR(-EAGAIN) if the index changed under us
+ * and the caller has to look again.
+ */
+static struct page *rdsk_unshare_page(struct rdsk_device *rdsk, sector_t sector, gfp_t gfp)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	struct rdsk_free_batch *holder;
+	struct page *page, *copy, *cur;
+
+	copy = rdsk_alloc_pages(rdsk, idx, gfp | __GFP_HIGHMEM | __GFP_NOWARN, 0);
+	holder = rdsk_alloc_free_batch(rdsk, 1, gfp | __GFP_NOWARN);
+	if (!copy || !holder)
+		goto out_nomem;
+
+	/* Pin the original so it cannot be freed and reused while we copy. */
+	rcu_read_lock();
+	page = rdsk_lookup_page(rdsk, sector);
+	if (page && (!rdsk_page_shared(page) || !get_page_unless_zero(page)))
+		page = NULL;
+	rcu_read_unlock();
+	if (!page) {
+		rdsk_free_new_page(rdsk, copy);
+		kfree(holder);
+		return ERR_PTR(-EAGAIN);
+	}
+
+	copy_highpage(copy, page);
+	rdsk_set_page_index(copy, idx);
+	cur = xa_cmpxchg(&rdsk_shard(rdsk, idx)->pages, idx, page, copy, gfp);
+	if (cur != page) {
+		put_page(page);
+		if (xa_is_err(cur))
+			goto out_nomem;
+		rdsk_free_new_page(rdsk, copy);
+		kfree(holder);
+		return ERR_PTR(-EAGAIN);
+	}
+
+	rdsk_count_node(rdsk, page, -1);
+	rdsk_count_node(rdsk, copy, 1);
+	this_cpu_inc(rdsk->stats->cow_copies);
+	put_page(page);
+	holder->pages[holder->nr++] = page;
+	call_rcu(&holder->rcu, rdsk_free_batch_rcu);
+	return copy;
+
+out_nomem:
+	if (copy)
+		rdsk_free_new_page(rdsk, copy);
+	kfree(holder);
+	rdsk_count_alloc_fail(rdsk, idx);
+	return NULL;
+}
+
+/* Pages in the index that are also held by another device. */
+static unsigned long rdsk_shared_pages(struct rdsk_device *rdsk)
+{
+	struct rdsk_shard *shards;
+	unsigned long idx, shared = 0;
+	struct page *page;
+	int i;
+
+	/* A flush may swap the index out; the old one is freed after a grace period. */
+	for (i = 0; i < RDSK_SHARDS; i++) {
+		rcu_read_lock();
+		shards = READ_ONCE(rdsk->rdsk_shards);
+		xa_for_each(&shards[i].pages, idx, page)
+			if (rdsk_page_shared(page))
+				shared++;
+		rcu_read_unlock();
+		cond_resched();
+	}
+	return shared;
+}
+
+/* Make sure a page present at sector is private to this device. */
+static int rdsk_make_private(struct rdsk_device *rdsk, sector_t sector, gfp_t gfp)
+{
+	struct page *page;
+	bool shared;
+
+	do {
+		rcu_read_lock();
+		page = rdsk_lookup_page(rdsk, sector);
+		shared = page && rdsk_page_shared(page);
+		rcu_read_unlock();
+		if (!shared)
+			break;
+		page = rdsk_unshare_page(rdsk, sector, gfp);
+		if (!page)
+			return -ENOSPC;
+	} while (IS_ERR(page));
+	/* Pairs with the reference drop after the grace period; see rdsk_page_shared(). */
+	smp_rmb();
+	return SUCCESS;
+}
+#endif
+
+#ifdef RDSK_COMPRESS
+static inline struct mutex *rdsk_zlock(struct rdsk_comp *comp, pgoff_t idx)
+{
+	return &comp->locks[idx & (RDSK_ZLOCKS - 1)];
+}
+
+static unsigned long rdsk_zs_malloc(struct zs_pool *pool, size_t len, gfp_t gfp)
+{
+	unsigned long handle;
+
+	gfp |= __GFP_NOWARN | __GFP_HIGHMEM | __GFP_MOVABLE;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,17,0)
+	handle = zs_malloc(pool, len, gfp, NUMA_NO_NODE);
+#else
+	handle = zs_malloc(pool, len, gfp);
+#endif
+	return IS_ERR_VALUE(handle) ? 0 : handle;
+}
+
+static void rdsk_zs_write(struct zs_pool *pool, unsigned long handle,
+			  void *src, unsigned int len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,15,0)
+	zs_obj_write(pool, handle, src, len);
+#else
+	void *dst = zs_map_object(pool, handle, ZS_MM_WO);
+
+	memcpy(dst, src, len);
+	zs_unmap_object(pool, handle);
+#endif
+}
+
+/* Compress one page into zs->cbuf and return the length to store. */
+static unsigned int rdsk_compress(struct rdsk_comp *comp, struct rdsk_zstrm *zs,
+				  const void *src)
+{
+	size_t len = 0;
+
+	switch (comp->algo) {
+#ifdef RDSK_LZ4
+	case RDSK_COMP_LZ4:
+		len = LZ4_compress_default(src, zs->cbuf, PAGE_SIZE, 2 * PAGE_SIZE, zs->wrkmem);
+		break;
+#endif
+#ifdef RDSK_ZSTD
+	case RDSK_COMP_ZSTD: {
+		zstd_parameters params = zstd_get_params(RDSK_ZSTD_LEVEL, PAGE_SIZE);
+
+		len = zstd_compress_cctx(zs->cctx, zs->cbuf, 2 * PAGE_SIZE, src, PAGE_SIZE, &params);
+		if (zstd_is_error(len))
+			len = 0;
+		break;
+	}
+#endif
+	default:
+		break;
+	}
+
+	/* Not worth the decompression cost on every read; keep it raw. */
+	if (!len || len > RDSK_ZMAX)
+		return PAGE_SIZE;
+	return len;
+}
+
+static int rdsk_decompress(struct rdsk_comp *comp, struct rdsk_zstrm *zs,
+			   const void *src, unsigned int len, void *dst)
+{
+	if (len == PAGE_SIZE) {
+		memcpy(dst, src, PAGE_SIZE);
+		return SUCCESS;
+	}
+
+	switch (comp->algo) {
+#ifdef RDSK_LZ4
+	case RDSK_COMP_LZ4:
+		if (LZ4_decompress_safe(src, dst, len, PAGE_SIZE) == PAGE_SIZE)
+			return SUCCESS;
+		break;
+#endif
+#ifdef RDSK_ZSTD
+	case RDSK_COMP_ZSTD: {
+		size_t ret = zstd_decompress_dctx(zs->dctx, dst, PAGE_SIZE, src, len);
+
+		if (!zstd_is_error(ret) && ret == PAGE_SIZE)
+			return SUCCESS;
+		break;
+	}
+#endif
+	default:
+		break;
+	}
+	return -EIO;
+}
+
+/* Expand the page at idx into dst. The caller holds the index and stream locks. */
+static int rdsk_zread_page(struct rdsk_comp *comp, struct rdsk_zstrm *zs,
+			   pgoff_t idx, void *dst)
+{
+	struct rdsk_zentry *e = &comp->table[idx];
+	void *src;
+	int err;
+
+	if (!e->len) {
+		memset(dst, 0, PAGE_SIZE);
+		return SUCCESS;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,15,0)
+	src = zs_obj_read_begin(comp->pool, e->handle, zs->cbuf);
+	err = rdsk_decompress(comp, zs, src, e->len, dst);
+	zs_obj_read_end(comp->pool, e->handle, src);
+#else
+	src = zs_map_object(comp->pool, e->handle, ZS_MM_RO);
+	err = rdsk_decompress(comp, zs, src, e->len, dst);
+	zs_unmap_object(comp->pool, e->handle);
+#endif
+	return err;
+}
+
+/* Release the object at idx, if any. The caller holds the index lock. */
+static void rdsk_zfree_entry(struct rdsk_device *rdsk, pgoff_t idx)
+{
+	struct rdsk_comp *comp = rdsk->comp;
+	struct rdsk_zentry *e = &comp->table[idx];
+
+	if (!e->len)
+		return;
+	zs_free(comp->pool, e->handle);
+	atomic64_sub(e->len, &comp->stored);
+	e->handle = 0;
+	e->len = 0;
+	rdsk_count_frees(rdsk, 1);
+}
+
+/* Read or write len bytes at offset within page index idx. */
+static int rdsk_zdo_page(struct rdsk_device *rdsk, void *mem, unsigned int offset,
+			 unsigned int len, bool is_write, pgoff_t idx, gfp_t gfp)
+{
+	struct rdsk_comp *comp = rdsk->comp;
+	struct rdsk_zentry *e = &comp->table[idx];
+	struct mutex *lock = rdsk_zlock(comp, idx);
+	struct rdsk_zstrm *zs;
+	unsigned long handle;
+	unsigned int clen;
+	void *src = mem;
+	int err = SUCCESS;
+
+	mutex_lock(lock);
+	zs = raw_cpu_ptr(comp->strm);
+	mutex_lock(&zs->lock);
+
+	if (!is_write) {
+		if (len == PAGE_SIZE) {
+			err = rdsk_zread_page(comp, zs, idx, mem);
+		} else {
+			err = rdsk_zread_page(comp, zs, idx, zs->buf);
+			if (!err)
+				memcpy(mem, zs->buf + offset, len);
+		}
+		goto out;
+	}
+
+	/* An all-zero page reads back from a hole just the same. */
+	if (len == PAGE_SIZE && !memchr_inv(mem, 0, PAGE_SIZE)) {
+		rdsk_zfree_entry(rdsk, idx);
+		this_cpu_inc(rdsk->stats->zero_elided);
+		goto out;
+	}
+
+	/* Partial page writes have to merge with what is already stored. */
+	if (len != PAGE_SIZE) {
+		err = rdsk_zread_page(comp, zs, idx, zs->buf);
+		if (err)
+			goto out;
+		memcpy(zs->buf + offset, mem, len);
+		src = zs->buf;
+	}
+
+	clen = rdsk_compress(comp, zs, src);
+	handle = rdsk_zs_malloc(comp->pool, clen, gfp);
+	if (!handle) {
+		rdsk_count_alloc_fail(rdsk, idx);
+		err = -ENOSPC;
+		goto out;
+	}
+	rdsk_zs_write(comp->pool, handle, clen == PAGE_SIZE ? src : zs->cbuf, clen);
+
+	if (e->len) {
+		zs_free(comp->pool, e->handle);
+		atomic64_sub(e->len, &comp->stored);
+	} else {
+		rdsk_count_pages(rdsk, 1);
+	}
+	e->handle = handle;
+	e->len = clen;
+	atomic64_add(clen, &comp->stored);
+out:
+	mutex_unlock(&zs->lock);
+	mutex_unlock(lock);
+	return err;
+}
+
+/*
+ * Compressed counterpart of rdsk_do_bvec(). The page is mapped with
+ * kmap_local_page() since compressing may sleep in zs_malloc().
+ */
+static int rdsk_do_zbvec(struct rdsk_device *rdsk, struct page *page, unsigned int len,
+			 unsigned int off, bool is_write, sector_t sector, gfp_t gfp)
+{
+	sector_t end = sector + (len >> SECTOR_SHIFT);
+	void *mem = kmap_local_page(page);
+	int err = SUCCESS;
+
+	if (is_write)
+		flush_dcache_page(page);
+	while (len && !err) {
+		unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		unsigned int copy = min_t(unsigned int, len, PAGE_SIZE - offset);
+
+		err = rdsk_zdo_page(rdsk, mem + off, offset, copy, is_write,
+				    sector >> PAGE_SECTORS_SHIFT, gfp);
+		off += copy;
+		len -= copy;
+		sector += copy >> SECTOR_SHIFT;
+	}
+	if (!is_write)
+		flush_dcache_page(page);
+	kunmap_local(mem);
+
+	if (is_write && !err)
+		rdsk_note_written(rdsk, end);
+	return err;
+}
+
+static void rdsk_comp_destroy(struct rdsk_comp *comp)
+{
+	int cpu;
+
+	if (!comp)
+		return;
+	if (comp->strm) {
+		for_each_possible_cpu(cpu) {
+			struct rdsk_zstrm *zs = per_cpu_ptr(comp->strm, cpu);
+
+			kfree(zs->buf);
+			kfree(zs->cbuf);
+			kvfree(zs->wrkmem);
+		}
+		free_percpu(comp->strm);
+	}
+	if (comp->pool)
+		zs_destroy_pool(comp->pool);
+	kvfree(comp->table);
+	kfree(comp);
+}
+
+static int rdsk_comp_init(struct rdsk_device *rdsk)
+{
+	struct rdsk_comp *comp;
+	size_t wrksz = 0, csz = 0;
+	char name[DISK_NAME_LEN];
+	int cpu, i;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return -ENOMEM;
+	comp->algo = rdsk->comp_algo;
+	comp->nr_pages = DIV_ROUND_UP(rdsk->size, PAGE_SIZE);
+	atomic64_set(&comp->stored, 0);
+	for (i = 0; i < RDSK_ZLOCKS; i++)
+		mutex_init(&comp->locks[i]);
+
+	comp->table = kvcalloc(comp->nr_pages, sizeof(*comp->table), GFP_KERNEL);
+	if (!comp->table)
+		goto out_free;
+	snprintf(name, sizeof(name), "rd%d", rdsk->num);
+	comp->pool = zs_create_pool(name);
+	if (!comp->pool)
+		goto out_free;
+	comp->strm = alloc_percpu(struct rdsk_zstrm);
+	if (!comp->strm)
+		goto out_free;
+
+#ifdef RDSK_LZ4
+	if (comp->algo == RDSK_COMP_LZ4)
+		wrksz = LZ4_MEM_COMPRESS;
+#endif
+#ifdef RDSK_ZSTD
+	if (comp->algo == RDSK_COMP_ZSTD) {
+		zstd_parameters params = zstd_get_params(RDSK_ZSTD_LEVEL, PAGE_SIZE);
+
+		csz = ALIGN(zstd_cctx_workspace_bound(&params.cParams), 8);
+		wrksz = csz + zstd_dctx_workspace_bound();
+	}
+#endif
+
+	for_each_possible_cpu(cpu) {
+		struct rdsk_zstrm *zs = per_cpu_ptr(comp->strm, cpu);
+
+		mutex_init(&zs->lock);
+		zs->buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		zs->cbuf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+		zs->wrkmem = kvmalloc(wrksz, GFP_KERNEL);
+		if (!zs->buf || !zs->cbuf || !zs->wrkmem)
+			goto out_free;
+#ifdef RDSK_ZSTD
+		if (comp->algo == RDSK_COMP_ZSTD) {
+			zs->cctx = zstd_init_cctx(zs->wrkmem, csz);
+			zs->dctx = zstd_init_dctx(zs->wrkmem + csz, wrksz - csz);
+			if (!zs->cctx || !zs->dctx)
+				goto out_free;
+		}
+#endif
+	}
+
+	rdsk->comp = comp;
+	return SUCCESS;
+
+out_free:
+	pr_err("%s: Unable to set up compression for rd%d.\n", PREFIX, rdsk->num);
+	rdsk_comp_destroy(comp);
+	return -ENOMEM;
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+/* Zero n bytes at sector in place. The range must not cross a page boundary. */
+static int rdsk_zero_range(struct rdsk_device *rdsk, sector_t sector, unsigned int n)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+	struct page *page;
+	void *dst;
+
+#ifdef RDSK_COMPRESS
+	if (rdsk->comp) {
+		pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+
+		if (n == PAGE_SIZE) {
+			mutex_lock(rdsk_zlock(rdsk->comp, idx));
+			rdsk_zfree_entry(rdsk, idx);
+			mutex_unlock(rdsk_zlock(rdsk->comp, idx));
+		} else if (rdsk->comp->table[idx].len) {
+			return rdsk_zdo_page(rdsk, page_address(ZERO_PAGE(0)), offset, n, true,
+					     idx, GFP_NOIO);
+		}
+		return SUCCESS;
+	}
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	if (rdsk->cow && rdsk_make_private(rdsk, sector, GFP_NOIO))
+		return -ENOSPC;
+#endif
+
+	rcu_read_lock();
+#ifdef RDSK_MOVABLE
+	if (rdsk->movable)
+		read_lock(&rdsk_shard(rdsk, sector >> PAGE_SECTORS_SHIFT)->mig_lock);
+#endif
+	page = rdsk_lookup_page(rdsk, sector);
+	if (page) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+		dst = kmap_atomic(page);
+#else
+		dst = kmap_atomic(page, KM_USER1);
+#endif
+		memset(dst + offset, 0, n);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+		kunmap_atomic(dst);
+#else
+		kunmap_atomic(dst, KM_USER1);
+#endif
+	}
+#ifdef RDSK_MOVABLE
+	if (rdsk->movable)
+		read_unlock(&rdsk_shard(rdsk, sector >> PAGE_SECTORS_SHIFT)->mig_lock);
+#endif
+	rcu_read_unlock();
+	return SUCCESS;
+}
+#endif
+
+/* Free every page in the shard and return how many base pages that was. */
+static unsigned long rdsk_free_shard(struct rdsk_device *rdsk, struct rdsk_shard *shard)
+{
+	unsigned long freed = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	struct page *page;
+	unsigned long idx;
+	long nr;
+
+	xa_for_each(&shard->pages, idx, page) {
+		BUG_ON(rdsk_page_index(page) != idx);
+		nr = 1UL << compound_order(page);
+		freed += nr;
+		rdsk_count_node(rdsk, page, -nr);
+		rdsk_free_page(page);
+		cond_resched();
+	}
+	xa_destroy(&shard->pages);
+#else
+	unsigned long pos = 0;
+	struct page *pages[FREE_BATCH];
+	int nr_pages;
+
+	do {
+		int i;
+
+		nr_pages = radix_tree_gang_lookup(&shard->pages,
+						  (void **)pages, pos,
+						  FREE_BATCH);
+
+		for (i = 0; i < nr_pages; i++) {
+			void *ret;
+
+			BUG_ON(rdsk_page_index(pages[i]) < pos);
+			pos = rdsk_page_index(pages[i]);
+			ret = radix_tree_delete(&shard->pages, pos);
+			BUG_ON(!ret || ret != pages[i]);
+			rdsk_count_node(rdsk, pages[i], -1);
+			__free_page(pages[i]);
+			freed++;
+		}
+		pos++;
+	} while (nr_pages == FREE_BATCH);
+#endif
+	return freed;
+}
+
+static void rdsk_free_pages(struct rdsk_device *rdsk)
+{
+	unsigned long freed = 0;
+	int i;
+
+#ifdef RDSK_COMPRESS
+	if (rdsk->comp) {
+		pgoff_t idx;
+
+		for (idx = 0; idx < rdsk->comp->nr_pages; idx++) {
+			rdsk_zfree_entry(rdsk, idx);
+			if (!(idx & (FREE_BATCH - 1)))
+				cond_resched();
+		}
+		return;
+	}
+#endif
+
+	if (!rdsk->rdsk_shards)
+		return;
+#ifdef RDSK_MOVABLE
+	/* Every page has to be unmarked before the device goes away. */
+	if (rdsk->movable) {
+		rdsk_discard_pages(rdsk, 0, DIV_ROUND_UP(rdsk->size, PAGE_SIZE) - 1);
+		return;
+	}
+#endif
+	for (i = 0; i < RDSK_SHARDS; i++)
+		freed += rdsk_free_shard(rdsk, &rdsk->rdsk_shards[i]);
+	rdsk_count_frees(rdsk, freed);
+}
+
+#ifdef RDSK_ASYNC_TEARDOWN
+/*
+ * Freeing the index of a large device page by page takes long enough to
+ * stall the management interface. Flush and detach therefore unlink the
+ * whole shard array from the device in one step and leave the pages to one
+ * work item per shard on the unbound rdsk_wq, so that several CPUs return
+ * them in parallel while the device is already empty (or gone). The number
+ * of pages still waiting is reported in /sys/kernel/rapiddisk/teardown.
+ */
+struct rdsk_reap;
+
+struct rdsk_reap_work {
+	struct work_struct work;
+	struct rdsk_reap *reap;
+	int shard;
+};
+
+struct rdsk_reap {
+	struct rdsk_shard *shards;
+	atomic_t pending;		/* shards not emptied yet */
+	atomic_long_t left;		/* pages of this job not freed yet */
+	struct rdsk_reap_work works[RDSK_SHARDS];
+};
+
+static atomic_t rdsk_reap_jobs = ATOMIC_INIT(0);
+static atomic_long_t rdsk_reap_pages = ATOMIC_LONG_INIT(0);
+
+static void rdsk_reap_fn(struct work_struct *work)
+{
+	struct rdsk_reap_work *rw = container_of(work, struct rdsk_reap_work, work);
+	struct rdsk_reap *reap = rw->reap;
+	struct xarray *pages = &reap->shards[rw->shard].pages;
+	struct page *page;
+	unsigned long idx;
+	long nr;
+
+	xa_for_each(pages, idx, page) {
+		nr = 1L << compound_order(page);
+		atomic_long_sub(nr, &reap->left);
+		atomic_long_sub(nr, &rdsk_reap_pages);
+		rdsk_free_page(page);
+		cond_resched();
+	}
+	xa_destroy(pages);
+
+	if (!atomic_dec_and_test(&reap->pending))
+		return;
+	/* Whatever the usage counter got wrong must not linger in the total. */
+	atomic_long_sub(atomic_long_read(&reap->left), &rdsk_reap_pages);
+	atomic_dec(&rdsk_reap_jobs);
+	/* rdsk_shared_pages() may still be looking at the array. */
+	synchronize_rcu();
+	kfree(reap->shards);
+	kfree(reap);
+}
+
+/*
+ * Hand the page index of rdsk over to reap and install fresh in its place
+ * (NULL on detach). Nothing may look up pages of the device meanwhile: the
+ * caller either freezes the queue or has already deleted the disk.
+ */
+static void rdsk_reap_index(struct rdsk_device *rdsk, struct rdsk_reap *reap,
+			    struct rdsk_shard *fresh)
+{
+	unsigned long nr = rdsk_page_count(rdsk);
+	int cpu, nid, i;
+	long node;
+
+	reap->shards = rdsk->rdsk_shards;
+	WRITE_ONCE(rdsk->rdsk_shards, fresh);
+
+	/* The pages are accounted as freed now, only the memory comes back later. */
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		node = 0;
+		for_each_possible_cpu(cpu)
+			node += per_cpu_ptr(rdsk->node_pages, cpu)[nid];
+		this_cpu_sub(rdsk->node_pages[nid], node);
+	}
+	rdsk_count_frees(rdsk, nr);
+
+	atomic_long_set(&reap->left, nr);
+	atomic_long_add(nr, &rdsk_reap_pages);
+	atomic_inc(&rdsk_reap_jobs);
+	atomic_set(&reap->pending, RDSK_SHARDS);
+	for (i = 0; i < RDSK_SHARDS; i++) {
+		reap->works[i].reap = reap;
+		reap->works[i].shard = i;
+		INIT_WORK(&reap->works[i].work, rdsk_reap_fn);
+		queue_work(rdsk_wq, &reap->works[i].work);
+	}
+}
+
+static ssize_t teardown_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "jobs %d\npages_pending %ld\n", atomic_read(&rdsk_reap_jobs),
+		       max(atomic_long_read(&rdsk_reap_pages), 0L));
+}
+#endif
+
+/* Drop all data of a live device, i.e. for IOCTL_RD_BLKFLSBUF. */
+static void rdsk_flush_pages(struct rdsk_device *rdsk)
+{
+#ifdef RDSK_ASYNC_TEARDOWN
+	struct rdsk_shard *fresh = NULL;
+	struct rdsk_reap *reap = NULL;
+	unsigned int memflags;
+
+	/* Allocate before the freeze; reclaim may want to write to this device. */
+	if (rdsk->comp_algo == RDSK_COMP_NONE && !rdsk->movable) {
+		fresh = rdsk_alloc_shards();
+		reap = kzalloc(sizeof(*reap), GFP_KERNEL);
+	}
+	memflags = rdsk_freeze(rdsk);
+	if (fresh && reap) {
+		rdsk_reap_index(rdsk, reap, fresh);
+	} else {
+		kfree(fresh);
+		kfree(reap);
+		/* Freed in place, so no bio may be using the entries meanwhile. */
+		rdsk_free_pages(rdsk);
+	}
+#ifdef RDSK_ZONED
+	/* The data is gone, so no zone may claim to hold any. */
+	if (rdsk->zoned)
+		rdsk_zones_empty(rdsk);
+#endif
+	rdsk_unfreeze(rdsk, memflags);
+#else
+	rdsk_free_pages(rdsk);
+#endif
+}
+
+/*
+ * Prealloc mode populates the device up front so the I/O path never has to
+ * allocate. The index range is cut into stripe aligned slices, one for each
+ * online CPU, and every slice is filled by a kworker bound to that CPU. Under
+ * the default NUMA policy the pages therefore come from the node local to the
+ * worker and the device ends up spread across nodes in proportion to their
+ * CPUs.
+ */
+struct rdsk_populate_work {
+	struct work_struct work;
+	struct rdsk_device *rdsk;
+	pgoff_t start, end;
+	gfp_t gfp;
+	atomic_t *failed;
+};
+
+static void rdsk_populate_fn(struct work_struct *work)
+{
+	struct rdsk_populate_work *pw = container_of(work, struct rdsk_populate_work, work);
+	pgoff_t idx;
+
+	for (idx = pw->start; idx < pw->end; idx++) {
+		/* Give up early once any other worker ran out of memory. */
+		if (!(idx & ((1UL << RDSK_SHARD_SHIFT) - 1)) && atomic_read(pw->failed))
+			return;
+		if (!rdsk_insert_page(pw->rdsk, (sector_t)idx << PAGE_SECTORS_SHIFT, pw->gfp)) {
+			atomic_set(pw->failed, 1);
+			return;
+		}
+		cond_resched();
+	}
+}
+
+/*
+ * Run fn over page indexes [start, end), one slice per online CPU, and wait
+ * for all of them. Returns -ENOMEM if any worker flagged a failure.
+ */
+static int rdsk_run_per_cpu(struct rdsk_device *rdsk, pgoff_t start, pgoff_t end, gfp_t gfp,
+			    work_func_t fn)
+{
+	struct rdsk_populate_work *works;
+	atomic_t failed = ATOMIC_INIT(0);
+	unsigned long per_cpu, nr = 0, i;
+	int cpu;
+
+	works = kcalloc(nr_cpu_ids, sizeof(*works), GFP_KERNEL);
+	if (!works)
+		return -ENOMEM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	cpus_read_lock();
+#else
+	get_online_cpus();
+#endif
+	per_cpu = DIV_ROUND_UP(end - start, 1UL << RDSK_SHARD_SHIFT);
+	per_cpu = DIV_ROUND_UP(per_cpu, num_online_cpus()) << RDSK_SHARD_SHIFT;
+	for_each_online_cpu(cpu) {
+		struct rdsk_populate_work *pw = &works[nr];
+
+		if (start + nr * per_cpu >= end)
+			break;
+		pw->rdsk = rdsk;
+		pw->start = start + nr * per_cpu;
+		pw->end = min_t(pgoff_t, end, pw->start + per_cpu);
+		pw->gfp = gfp;
+		pw->failed = &failed;
+		INIT_WORK(&pw->work, fn);
+		queue_work_on(cpu, system_long_wq, &pw->work);
+		nr++;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	cpus_read_unlock();
+#else
+	put_online_cpus();
+#endif
+
+	for (i = 0; i < nr; i++)
+		flush_work(&works[i].work);
+	kfree(works);
+
+	return atomic_read(&failed) ? -ENOMEM : SUCCESS;
+}
+
+/* Populate page indexes [start, end). The caller frees the pages on failure. */
+static int rdsk_populate(struct rdsk_device *rdsk, pgoff_t start, pgoff_t end, gfp_t gfp)
+{
+	long avail;
+
+	if (start >= end)
+		return SUCCESS;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
+	avail = si_mem_available();
+#else
+	{
+		struct sysinfo si;
+
+		si_meminfo(&si);
+		avail = si.freeram;
+	}
+#endif
+	if (avail < 0 || end - start > (unsigned long)avail) {
+		pr_err("%s: Not enough memory to preallocate rd%d: %lu pages needed, %ld available.\n",
+		       PREFIX, rdsk->num, end - start, avail);
+		return -ENOMEM;
+	}
+
+	if (rdsk_run_per_cpu(rdsk, start, end, gfp, rdsk_populate_fn) != SUCCESS) {
+		pr_err("%s: Unable to preallocate rd%d.\n", PREFIX, rdsk->num);
+		return -ENOMEM;
+	}
+	return SUCCESS;
+}
+
+static int copy_to_rdsk_setup(struct rdsk_device *rdsk,
+			      sector_t sector, size_t n, gfp_t gfp)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+	size_t copy;
+
+	copy = min_t(size_t, n, PAGE_SIZE - offset);
+	if (!rdsk_insert_page(rdsk, sector, gfp))
+		return -ENOSPC;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	if (rdsk->cow && rdsk_make_private(rdsk, sector, gfp))
+		return -ENOSPC;
+#endif
+	if (copy < n) {
+		sector += copy >> SECTOR_SHIFT;
+		if (!rdsk_insert_page(rdsk, sector, gfp))
+			return -ENOSPC;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+		if (rdsk->cow && rdsk_make_private(rdsk, sector, gfp))
+			return -ENOSPC;
+#endif
+	}
+	return SUCCESS;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+/*
+ * Discard or write zeroes n bytes at sector. Partial pages at either end
+ * are zeroed in place. Whole pages are released back to the system unless
+ * the device has to keep them or the caller asked not to unmap.
+ */
+static int discard_from_rdsk(struct rdsk_device *rdsk,
+			     sector_t sector, size_t n, bool unmap)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+#ifdef RDSK_MIRROR
+	sector_t first = sector;
+	size_t total = n;
+#endif
+	pgoff_t idx, last;
+	int err = SUCCESS;
+
+	if (offset) {
+		unsigned int len = min_t(size_t, n, PAGE_SIZE - offset);
+
+		err = rdsk_zero_range(rdsk, sector, len);
+		if (err)
+			goto out;
+		sector += len >> SECTOR_SHIFT;
+		n -= len;
+	}
+	if (n & ~PAGE_MASK) {
+		unsigned int len = n & ~PAGE_MASK;
+
+		n -= len;
+		err = rdsk_zero_range(rdsk, sector + (n >> SECTOR_SHIFT), len);
+		if (err)
+			goto out;
+	}
+	if (!n)
+		goto out;
+
+	idx = sector >> PAGE_SECTORS_SHIFT;
+	last = idx + (n >> PAGE_SHIFT) - 1;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	if (unmap && rdsk_can_free_pages(rdsk)
+#ifdef RDSK_COMPRESS
+	    && !rdsk->comp
+#endif
+	    ) {
+		rdsk_discard_pages(rdsk, idx, last);
+		goto out;
+	}
+#endif
+	for (; idx <= last && !err; idx++) {
+		err = rdsk_zero_range(rdsk, (sector_t)idx << PAGE_SECTORS_SHIFT, PAGE_SIZE);
+		if (!(idx & (FREE_BATCH - 1)))
+			cond_resched();
+	}
+out:
+#ifdef RDSK_MIRROR
+	/* Also covers a partial failure; the pass copies whatever is there. */
+	rdsk_mirror_dirty(rdsk, first, total);
+#endif
+	return err;
+}
+#endif
+
+static void copy_to_rdsk(struct rdsk_device *rdsk, const void *src,
+			 sector_t sector, size_t n)
+{
+	struct page *page;
+	void *dst;
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+	size_t copy;
+
+	copy = min_t(size_t, n, PAGE_SIZE - offset);
+	/*
+	 * Pages are only ever removed while the device is idle, or by a
+	 * concurrent zero page write to the same index. In the latter case
+	 * the page stays valid until the RCU read side is left, and the
+	 * zero page write is simply ordered after this one.
+	 */
+	rcu_read_lock();
+	page = rdsk_lookup_page(rdsk, sector);
+	if (page) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+		dst = kmap_atomic(page);
+#else
+		dst = kmap_atomic(page, KM_USER1);
+#endif
+		memcpy(dst + offset, src, copy);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+		kunmap_atomic(dst);
+#else
+		kunmap_atomic(dst, KM_USER1);
+#endif
+	}
+
+	if (copy < n) {
+		src += copy;
+		sector += copy >> SECTOR_SHIFT;
+		copy = n - copy;
+		page = rdsk_lookup_page(rdsk, sector);
+		if (page) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+			dst = kmap_atomic(page);
+#else
+			dst = kmap_atomic(page, KM_USER1);
+#endif
+			memcpy(dst, src, copy);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+			kunmap_atomic(dst);
+#else
+			kunmap_atomic(dst, KM_USER1);
+#endif
+		}
+	}
+	rcu_read_unlock();
+
+	rdsk_note_written(rdsk, sector + (n / BYTES_PER_SECTOR));
+}
+
+static void copy_from_rdsk(void *dst, struct rdsk_device *rdsk,
+			   sector_t sector, size_t n)
+{
+	struct page *page;
+	void *src;
+	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+	size_t copy;
+
+	copy = min_t(size_t, n, PAGE_SIZE - offset);
+	/* A concurrently elided page is not freed before rcu_read_unlock(). */
+	rcu_read_lock();
+	page = rdsk_lookup_page(rdsk, sector);
+
+	if (page) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+		src = kmap_atomic(page);
+#else
+		src = kmap_atomic(page, KM_USER1);
+#endif
+		memcpy(dst, src + offset, copy);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+		kunmap_atomic(src);
+#else
+		kunmap_atomic(src, KM_USER1);
+#endif
+	} else {
+		memset(dst, 0, copy);
+	}
+
+	if (copy < n) {
+		dst += copy;
+		sector += copy >> SECTOR_SHIFT;
+		copy = n - copy;
+		page = rdsk_lookup_page(rdsk, sector);
+		if (page) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+			src = kmap_atomic(page);
+#else
+			src = kmap_atomic(page, KM_USER1);
+#endif
+			memcpy(dst, src, copy);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+			kunmap_atomic(src);
+#else
+			kunmap_atomic(src, KM_USER1);
+#endif
+		} else {
+			memset(dst, 0, copy);
+		}
+	}
+	rcu_read_unlock();
+}
+
+#ifdef RDSK_MIRROR
+/* Copy nr pages starting at idx to the mirror file. Holes are punched out. */
+static int rdsk_mirror_write(struct rdsk_device *rdsk, pgoff_t idx, unsigned int nr)
+{
+	struct rdsk_mirror *m = rdsk->mirror;
+	size_t len = (size_t)nr << PAGE_SHIFT;
+	loff_t pos = (loff_t)idx << PAGE_SHIFT;
+	bool hole = true;
+	unsigned int i;
+	ssize_t ret;
+
+	for (i = 0; i < nr; i++) {
+		sector_t sector = (sector_t)(idx + i) << PAGE_SECTORS_SHIFT;
+
+		rcu_read_lock();
+		if (rdsk_lookup_page(rdsk, sector))
+			hole = false;
+		rcu_read_unlock();
+		copy_from_rdsk(m->buf + ((size_t)i << PAGE_SHIFT), rdsk, sector, PAGE_SIZE);
+	}
+
+	if (hole && !vfs_fallocate(m->filp, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len))
+		return SUCCESS;
+	ret = kernel_write(m->filp, m->buf, len, &pos);
+	if (ret != len)
+		return ret < 0 ? ret : -EIO;
+	m->bytes_written += len;
+	return SUCCESS;
+}
+
+/* Sleep off any lead over the configured rate, except while stopping. */
+static void rdsk_mirror_throttle(struct rdsk_mirror *m, unsigned long start, u64 bytes)
+{
+	unsigned long due;
+
+	if (!m->rate || kthread_should_stop())
+		return;
+	due = start + (unsigned long)div64_u64(bytes * HZ, (u64)m->rate << 20);
+	if (time_before(jiffies, due))
+		schedule_timeout_interruptible(due - jiffies);
+}
+
+/*
+ * One flush pass. The dirty bit of a page is cleared before the page is
+ * copied, so a write that lands during the copy sets it again and is picked
+ * up by the next pass. Runs of dirty pages are written in batches and the
+ * file is synced at the end, after which every write that completed before
+ * the pass started is durable.
+ */
+static int rdsk_mirror_pass(struct rdsk_device *rdsk)
+{
+	struct rdsk_mirror *m = rdsk->mirror;
+	unsigned long start = jiffies, nr_chunks, chunk;
+	u64 bytes = 0;
+	int err = SUCCESS;
+
+	mutex_lock(&m->lock);
+	nr_chunks = DIV_ROUND_UP(m->nr_pages, 1UL << RDSK_SHARD_SHIFT);
+	for_each_set_bit(chunk, m->dirty_chunks, nr_chunks) {
+		pgoff_t idx = chunk << RDSK_SHARD_SHIFT;
+		pgoff_t end = min_t(pgoff_t, m->nr_pages, idx + (1UL << RDSK_SHARD_SHIFT));
+
+		if (!test_and_clear_bit(chunk, m->dirty_chunks))
+			continue;
+		while ((idx = find_next_bit(m->dirty, end, idx)) < end) {
+			unsigned int nr = 0, i;
+
+			while (idx + nr < end && nr < RDSK_MIRROR_BATCH &&
+			       test_and_clear_bit(idx + nr, m->dirty))
+				nr++;
+			err = rdsk_mirror_write(rdsk, idx, nr);
+			if (err) {
+				/* Retry the run on the next pass. */
+				for (i = 0; i < nr; i++)
+					set_bit(idx + i, m->dirty);
+				set_bit(chunk, m->dirty_chunks);
+				goto out;
+			}
+			idx += nr;
+			bytes += (u64)nr << PAGE_SHIFT;
+			rdsk_mirror_throttle(m, start, bytes);
+			cond_resched();
+		}
+	}
+	if (bytes)
+		err = vfs_fsync(m->filp, 1);
+	if (!err)
+		WRITE_ONCE(m->synced, start);
+out:
+	if (err) {
+		m->errors++;
+		pr_warn_ratelimited("%s: Unable to write rd%d to %s (%d).\n",
+				    PREFIX, rdsk->num, m->path, err);
+	}
+	mutex_unlock(&m->lock);
+	return err;
+}
+
+static int rdsk_mirror_thread(void *data)
+{
+	struct rdsk_device *rdsk = data;
+
+	while (!kthread_should_stop()) {
+		rdsk_mirror_pass(rdsk);
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule_timeout(msecs_to_jiffies(RDSK_MIRROR_INTERVAL));
+		__set_current_state(TASK_RUNNING);
+	}
+	/* Leave a complete image behind on detach. */
+	rdsk_mirror_pass(rdsk);
+	return 0;
+}
+
+/* Rehydrate one slice of the device from the mirror file. */
+static void rdsk_mirror_load_fn(struct work_struct *work)
+{
+	struct rdsk_populate_work *pw = container_of(work, struct rdsk_populate_work, work);
+	struct rdsk_device *rdsk = pw->rdsk;
+	struct file *filp = rdsk->mirror->filp;
+	loff_t isize = i_size_read(file_inode(filp));
+	size_t len = RDSK_MIRROR_BATCH << PAGE_SHIFT;
+	pgoff_t idx;
+	void *buf;
+
+	buf = kvmalloc(len, GFP_KERNEL);
+	if (!buf) {
+		atomic_set(pw->failed, 1);
+		return;
+	}
+
+	for (idx = pw->start; idx < pw->end && !atomic_read(pw->failed); idx += RDSK_MIRROR_BATCH) {
+		unsigned int nr = min_t(pgoff_t, RDSK_MIRROR_BATCH, pw->end - idx), i;
+		loff_t pos = (loff_t)idx << PAGE_SHIFT;
+		ssize_t ret;
+
+		if (pos >= isize)
+			break;
+		ret = kernel_read(filp, buf, (size_t)nr << PAGE_SHIFT, &pos);
+		if (ret < 0) {
+			atomic_set(pw->failed, 1);
+			break;
+		}
+		memset(buf + ret, 0, ((size_t)nr << PAGE_SHIFT) - ret);
+
+		for (i = 0; i < nr; i++) {
+			void *src = buf + ((size_t)i << PAGE_SHIFT);
+			sector_t sector = (sector_t)(idx + i) << PAGE_SECTORS_SHIFT;
+
+			/* Zero pages stay holes, as if elided on write. */
+			if (!memchr_inv(src, 0, PAGE_SIZE))
+				continue;
+			if (copy_to_rdsk_setup(rdsk, sector, PAGE_SIZE, pw->gfp)) {
+				atomic_set(pw->failed, 1);
+				break;
+			}
+			copy_to_rdsk(rdsk, src, sector, PAGE_SIZE);
+		}
+		cond_resched();
+	}
+	kvfree(buf);
+}
+
+static void rdsk_mirror_destroy(struct rdsk_mirror *m)
+{
+	if (!m)
+		return;
+	if (m->filp)
+		filp_close(m->filp, NULL);
+	kvfree(m->dirty);
+	kvfree(m->dirty_chunks);
+	kvfree(m->buf);
+	kfree(m->path);
+	kfree(m);
+}
+
+/* Stop the mirror thread after a final pass. The file is closed on release. */
+static void rdsk_mirror_stop(struct rdsk_device *rdsk)
+{
+	if (rdsk->mirror && rdsk->mirror->task) {
+		kthread_stop(rdsk->mirror->task);
+		rdsk->mirror->task = NULL;
+	}
+}
+
+/*
+ * Open (or create) the mirror file, load whatever it holds into the device
+ * with one worker per CPU and start the mirror thread. Called before the
+ * disk goes live, so nothing races with the load.
+ */
+static int rdsk_mirror_init(struct rdsk_device *rdsk)
+{
+	struct rdsk_mirror *m = rdsk->mirror;
+	unsigned long nr_chunks;
+	loff_t isize;
+	int err;
+
+	m->nr_pages = DIV_ROUND_UP(rdsk->size, PAGE_SIZE);
+	nr_chunks = DIV_ROUND_UP(m->nr_pages, 1UL << RDSK_SHARD_SHIFT);
+	mutex_init(&m->lock);
+
+	m->filp = filp_open(m->path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (IS_ERR(m->filp)) {
+		err = PTR_ERR(m->filp);
+		m->filp = NULL;
+		pr_err("%s: Unable to open mirror file %s (%d).\n", PREFIX, m->path, err);
+		return err;
+	}
+	if (!S_ISREG(file_inode(m->filp)->i_mode)) {
+		pr_err("%s: Mirror file %s is not a regular file.\n", PREFIX, m->path);
+		return -EINVAL;
+	}
+
+	m->dirty = kvcalloc(BITS_TO_LONGS(m->nr_pages), sizeof(long), GFP_KERNEL);
+	m->dirty_chunks = kvcalloc(BITS_TO_LONGS(nr_chunks), sizeof(long), GFP_KERNEL);
+	m->buf = kvmalloc(RDSK_MIRROR_BATCH << PAGE_SHIFT, GFP_KERNEL);
+	if (!m->dirty || !m->dirty_chunks || !m->buf)
+		return -ENOMEM;
+
+	isize = i_size_read(file_inode(m->filp));
+	if (isize && rdsk_run_per_cpu(rdsk, 0, m->nr_pages, GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN,
+				      rdsk_mirror_load_fn) != SUCCESS) {
+		pr_err("%s: Unable to load rd%d from %s.\n", PREFIX, rdsk->num, m->path);
+		return -ENOMEM;
+	}
+	/* A sparse file of the full size keeps the image offsets simple. */
+	if (isize < rdsk->size) {
+		err = vfs_truncate(&m->filp->f_path, rdsk->size);
+		if (err)
+			return err;
+	}
+	m->synced = jiffies;
+
+	m->task = kthread_run(rdsk_mirror_thread, rdsk, "rdsk_mirror/%d", rdsk->num);
+	if (IS_ERR(m->task)) {
+		err = PTR_ERR(m->task);
+		m->task = NULL;
+		return err;
+	}
+	if (isize)
+		pr_info("%s: Loaded rd%d from %s.\n", PREFIX, rdsk->num, m->path);
+	return SUCCESS;
+}
+
+/* The device was wiped: drop all pending work and empty the file. Called with m->lock held. */
+static void rdsk_mirror_reset(struct rdsk_device *rdsk)
+{
+	struct rdsk_mirror *m = rdsk->mirror;
+
+	bitmap_zero(m->dirty, m->nr_pages);
+	bitmap_zero(m->dirty_chunks, DIV_ROUND_UP(m->nr_pages, 1UL << RDSK_SHARD_SHIFT));
+	if (vfs_truncate(&m->filp->f_path, 0) ||
+	    vfs_truncate(&m->filp->f_path, rdsk->size) || vfs_fsync(m->filp, 1)) {
+		m->errors++;
+		pr_warn("%s: Unable to clear mirror file %s.\n", PREFIX, m->path);
+	}
+	WRITE_ONCE(m->synced, jiffies);
+}
+#endif
+
+#ifdef RDSK_ZONED
+static inline struct rdsk_zone *rdsk_zone(struct rdsk_zoned *zd, sector_t sector)
+{
+	return &zd->zones[sector >> zd->zone_shift];
+}
+
+static inline bool rdsk_zone_is_conv(struct rdsk_zoned *zd, struct rdsk_zone *z)
+{
+	return z - zd->zones < zd->nr_conv;
+}
+
+static inline sector_t rdsk_zone_end(struct rdsk_zoned *zd, struct rdsk_zone *z)
+{
+	return z->start + (1ULL << zd->zone_shift);
+}
+
+static int rdsk_zoned_init(struct rdsk_device *rdsk, unsigned long long zone_size,
+			   unsigned int nr_conv, unsigned int max_open, unsigned int max_active)
+{
+	struct rdsk_zoned *zd;
+	unsigned int i, nr;
+
+	if (zone_size < PAGE_SIZE || !is_power_of_2(zone_size) || rdsk->size % zone_size) {
+		pr_err("%s: The zone size must be a power of two of at least %lu bytes that divides the size.\n",
+		       PREFIX, PAGE_SIZE);
+		return GENERIC_ERROR;
+	}
+	nr = rdsk->size / zone_size;
+	if (nr_conv >= nr || (max_open && max_active && max_open > max_active)) {
+		pr_err("%s: Invalid zone configuration: %u zones, %u conventional, %u max open, %u max active.\n",
+		       PREFIX, nr, nr_conv, max_open, max_active);
+		return GENERIC_ERROR;
+	}
+
+	zd = kvzalloc(struct_size(zd, zones, nr), GFP_KERNEL);
+	if (!zd)
+		return GENERIC_ERROR;
+	spin_lock_init(&zd->lock);
+	zd->zone_shift = ilog2(zone_size >> SECTOR_SHIFT);
+	zd->nr_zones = nr;
+	zd->nr_conv = nr_conv;
+	zd->max_open = max_open;
+	zd->max_active = max_active;
+	for (i = 0; i < nr; i++) {
+		struct rdsk_zone *z = &zd->zones[i];
+
+		z->start = (sector_t)i << zd->zone_shift;
+		if (i < nr_conv) {
+			z->wp = rdsk_zone_end(zd, z);
+			z->cond = BLK_ZONE_COND_NOT_WP;
+		} else {
+			z->wp = z->start;
+			z->cond = BLK_ZONE_COND_EMPTY;
+		}
+	}
+	rdsk->zoned = zd;
+	return SUCCESS;
+}
+
+static int rdsk_report_zones(struct gendisk *disk, sector_t sector, unsigned int nr_zones,
+			     report_zones_cb cb, void *data)
+{
+	struct rdsk_device *rdsk = disk->private_data;
+	struct rdsk_zoned *zd = rdsk->zoned;
+	unsigned int i, done = 0;
+	int err;
+
+	for (i = sector >> zd->zone_shift; i < zd->nr_zones && done < nr_zones; i++, done++) {
+		struct rdsk_zone *z = &zd->zones[i];
+		struct blk_zone zone = {
+			.start = z->start,
+			.len = 1ULL << zd->zone_shift,
+			.capacity = 1ULL << zd->zone_shift,
+			.type = rdsk_zone_is_conv(zd, z) ? BLK_ZONE_TYPE_CONVENTIONAL :
+							   BLK_ZONE_TYPE_SEQWRITE_REQ,
+		};
+
+		spin_lock(&zd->lock);
+		zone.wp = z->wp;
+		zone.cond = z->cond;
+		spin_unlock(&zd->lock);
+
+		err = cb(&zone, i, data);
+		if (err)
+			return err;
+	}
+	return done;
+}
+
+/* Close some implicitly opened zone to make room for another one. */
+static bool rdsk_zone_close_implicit(struct rdsk_zoned *zd)
+{
+	unsigned int i, n = zd->nr_zones - zd->nr_conv;
+
+	for (i = 0; i < n; i++) {
+		struct rdsk_zone *z = &zd->zones[zd->nr_conv + (zd->close_hint + i) % n];
+
+		if (z->cond == BLK_ZONE_COND_IMP_OPEN) {
+			z->cond = z->wp == z->start ? BLK_ZONE_COND_EMPTY : BLK_ZONE_COND_CLOSED;
+			zd->nr_open--;
+			if (z->cond == BLK_ZONE_COND_EMPTY)
+				zd->nr_active--;
+			zd->close_hint = (zd->close_hint + i + 1) % n;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Move an empty or closed zone to cond, an open state. A closed zone is
+ * already active. Called with the lock held.
+ */
+static blk_status_t rdsk_zone_open(struct rdsk_zoned *zd, struct rdsk_zone *z,
+				   enum blk_zone_cond cond)
+{
+	if (z->cond == BLK_ZONE_COND_EMPTY && zd->max_active && zd->nr_active >= zd->max_active)
+		return BLK_STS_ZONE_ACTIVE_RESOURCE;
+	if (zd->max_open && zd->nr_open >= zd->max_open && !rdsk_zone_close_implicit(zd))
+		return BLK_STS_ZONE_OPEN_RESOURCE;
+	if (z->cond == BLK_ZONE_COND_EMPTY)
+		zd->nr_active++;
+	zd->nr_open++;
+	z->cond = cond;
+	return BLK_STS_OK;
+}
+
+/* Leave the open or closed state for an empty or full one. Called with the lock held. */
+static void rdsk_zone_deactivate(struct rdsk_zoned *zd, struct rdsk_zone *z)
+{
+	switch (z->cond) {
+	case BLK_ZONE_COND_IMP_OPEN:
+	case BLK_ZONE_COND_EXP_OPEN:
+		zd->nr_open--;
+		fallthrough;
+	case BLK_ZONE_COND_CLOSED:
+		zd->nr_active--;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Check a write or zone append against the write pointer and advance it.
+ * Zone appends are redirected to the write pointer, which is also where
+ * the caller finds the sector they were written to.
+ */
+static blk_status_t rdsk_zone_write(struct rdsk_device *rdsk, struct bio *bio)
+{
+	struct rdsk_zoned *zd = rdsk->zoned;
+	struct rdsk_zone *z = rdsk_zone(zd, bio->bi_iter.bi_sector);
+	sector_t nr = bio_sectors(bio);
+	blk_status_t sts = BLK_STS_OK;
+
+	if (rdsk_zone_is_conv(zd, z))
+		return bio_op(bio) == REQ_OP_ZONE_APPEND ? BLK_STS_IOERR : BLK_STS_OK;
+
+	spin_lock(&zd->lock);
+	if (bio_op(bio) == REQ_OP_ZONE_APPEND) {
+		if (bio->bi_iter.bi_sector != z->start) {
+			sts = BLK_STS_IOERR;
+			goto out;
+		}
+		bio->bi_iter.bi_sector = z->wp;
+	}
+	if (z->cond == BLK_ZONE_COND_FULL || bio->bi_iter.bi_sector != z->wp ||
+	    z->wp + nr > rdsk_zone_end(zd, z)) {
+		sts = BLK_STS_IOERR;
+		goto out;
+	}
+	if (z->cond == BLK_ZONE_COND_EMPTY || z->cond == BLK_ZONE_COND_CLOSED) {
+		sts = rdsk_zone_open(zd, z, BLK_ZONE_COND_IMP_OPEN);
+		if (sts)
+			goto out;
+	}
+	z->wp += nr;
+	if (z->wp == rdsk_zone_end(zd, z)) {
+		rdsk_zone_deactivate(zd, z);
+		z->cond = BLK_ZONE_COND_FULL;
+	}
+out:
+	spin_unlock(&zd->lock);
+	return sts;
+}
+
+/*
+ * Move the write pointer back over a write that failed, so that it can be
+ * retried at the same sector. A later zone append may already have been
+ * placed past it, in which case the hole it leaves reads back as zeros.
+ */
+static void rdsk_zone_write_undo(struct rdsk_device *rdsk, sector_t sector, sector_t nr)
+{
+	struct rdsk_zoned *zd = rdsk->zoned;
+	struct rdsk_zone *z = rdsk_zone(zd, sector);
+
+	if (rdsk_zone_is_conv(zd, z))
+		return;
+
+	spin_lock(&zd->lock);
+	if (z->wp == sector + nr) {
+		/* A full zone holds no active slot; take it back before leaving the state. */
+		if (z->cond == BLK_ZONE_COND_FULL) {
+			z->cond = BLK_ZONE_COND_CLOSED;
+			zd->nr_active++;
+		}
+		z->wp = sector;
+		if (z->wp == z->start) {
+			rdsk_zone_deactivate(zd, z);
+			z->cond = BLK_ZONE_COND_EMPTY;
+		}
+	}
+	spin_unlock(&zd->lock);
+}
+
+/* Reset one zone; its pages are released right away. */
+static blk_status_t rdsk_zone_reset(struct rdsk_device *rdsk, struct rdsk_zone *z)
+{
+	struct rdsk_zoned *zd = rdsk->zoned;
+
+	if (rdsk_zone_is_conv(zd, z))
+		return BLK_STS_IOERR;
+	spin_lock(&zd->lock);
+	rdsk_zone_deactivate(zd, z);
+	z->cond = BLK_ZONE_COND_EMPTY;
+	z->wp = z->start;
+	spin_unlock(&zd->lock);
+
+	rdsk_discard_pages(rdsk, z->start >> PAGE_SECTORS_SHIFT,
+			   (rdsk_zone_end(zd, z) >> PAGE_SECTORS_SHIFT) - 1);
+	return BLK_STS_OK;
+}
+
+/* Return every sequential zone to empty after all pages were flushed, as a reset all would. */
+static void rdsk_zones_empty(struct rdsk_device *rdsk)
+{
+	struct rdsk_zoned *zd = rdsk->zoned;
+	unsigned int i;
+
+	spin_lock(&zd->lock);
+	for (i = zd->nr_conv; i < zd->nr_zones; i++) {
+		zd->zones[i].cond = BLK_ZONE_COND_EMPTY;
+		zd->zones[i].wp = zd->zones[i].start;
+	}
+	zd->nr_open = 0;
+	zd->nr_active = 0;
+	spin_unlock(&zd->lock);
+}
+
+static blk_status_t rdsk_zone_mgmt(struct rdsk_device *rdsk, struct bio *bio)
+{
+	struct rdsk_zoned *zd = rdsk->zoned;
+	struct rdsk_zone *z;
+	blk_status_t sts = BLK_STS_OK;
+	unsigned int i;
+
+	if (bio_op(bio) == REQ_OP_ZONE_RESET_ALL) {
+		for (i = zd->nr_conv; i < zd->nr_zones; i++) {
+			rdsk_zone_reset(rdsk, &zd->zones[i]);
+			cond_resched();
+		}
+		return BLK_STS_OK;
+	}
+
+	z = rdsk_zone(zd, bio->bi_iter.bi_sector);
+	if (bio_op(bio) == REQ_OP_ZONE_RESET)
+		return rdsk_zone_reset(rdsk, z);
+	if (rdsk_zone_is_conv(zd, z))
+		return BLK_STS_IOERR;
+
+	spin_lock(&zd->lock);
+	switch (bio_op(bio)) {
+	case REQ_OP_ZONE_OPEN:
+		if (z->cond == BLK_ZONE_COND_IMP_OPEN)
+			z->cond = BLK_ZONE_COND_EXP_OPEN;
+		else if (z->cond == BLK_ZONE_COND_EMPTY || z->cond == BLK_ZONE_COND_CLOSED)
+			sts = rdsk_zone_open(zd, z, BLK_ZONE_COND_EXP_OPEN);
+		else if (z->cond == BLK_ZONE_COND_FULL)
+			sts = BLK_STS_IOERR;
+		break;
+	case REQ_OP_ZONE_CLOSE:
+		if (z->cond == BLK_ZONE_COND_IMP_OPEN || z->cond == BLK_ZONE_COND_EXP_OPEN) {
+			zd->nr_open--;
+			if (z->wp == z->start) {
+				zd->nr_active--;
+				z->cond = BLK_ZONE_COND_EMPTY;
+			} else {
+				z->cond = BLK_ZONE_COND_CLOSED;
+			}
+		}
+		break;
+	case REQ_OP_ZONE_FINISH:
+		if (z->cond == BLK_ZONE_COND_EMPTY && zd->max_active &&
+		    zd->nr_active >= zd->max_active) {
+			sts = BLK_STS_ZONE_ACTIVE_RESOURCE;
+			break;
+		}
+		rdsk_zone_deactivate(zd, z);
+		z->cond = BLK_ZONE_COND_FULL;
+		z->wp = rdsk_zone_end(zd, z);
+		break;
+	default:
+		sts = BLK_STS_NOTSUPP;
+		break;
+	}
+	spin_unlock(&zd->lock);
+	return sts;
+}
+#endif
+
+static int rdsk_do_bvec(struct rdsk_device *rdsk, struct page *page,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+			unsigned int len, unsigned int off, bool is_write,
+#else
+			unsigned int len, unsigned int off, int rw,
+#endif
+			sector_t sector, gfp_t gfp){
+	void *mem;
+	int err = SUCCESS;
+
+#ifdef RDSK_COMPRESS
+	if (rdsk->comp)
+		return rdsk_do_zbvec(rdsk, page, len, off, is_write, sector, gfp);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	/* memchr_inv() scans a word at a time and bails at the first non-zero byte. */
+	if (is_write && len == PAGE_SIZE && !(sector & (PAGE_SECTORS - 1)) &&
+	    rdsk_can_free_pages(rdsk)) {
+		bool zero;
+
+		mem = kmap_atomic(page);
+		zero = !memchr_inv(mem + off, 0, PAGE_SIZE);
+		kunmap_atomic(mem);
+		if (zero && rdsk_erase_page(rdsk, sector, gfp)) {
+			this_cpu_inc(rdsk->stats->zero_elided);
+			goto out;
+		}
+	}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+	if (is_write) {
+#else
+	if (rw != READ) {
+#endif
+		err = copy_to_rdsk_setup(rdsk, sector, len, gfp);
+		if (err)
+			goto out;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+	mem = kmap_atomic(page);
+#else
+	mem = kmap_atomic(page, KM_USER0);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+	if (!is_write) {
+#else
+	if (rw == READ) {
+#endif
+		copy_from_rdsk(mem + off, rdsk, sector, len);
+		flush_dcache_page(page);
+	} else {
+		flush_dcache_page(page);
+		copy_to_rdsk(rdsk, mem + off, sector, len);
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+	kunmap_atomic(mem);
+#else
+	kunmap_atomic(mem, KM_USER0);
+#endif
+out:
+#ifdef RDSK_MIRROR
+	if (is_write && !err)
+		rdsk_mirror_dirty(rdsk, sector, len);
+#endif
+	return err;
+}
+
+#ifdef RDSK_BULK_IO
+/*
+ * Plain page devices handle a bio in windows of up to RDSK_BIO_WINDOW pages
+ * within one shard stripe. All backing pages of a window are looked up in a
+ * single index walk and, for writes, the missing ones are allocated in bulk
+ * and installed under one lock acquisition. The multi-page bvecs of the bio
+ * are then copied while the RCU read side that resolved the window is still
+ * held, so that no page is looked up twice.
+ */
+struct rdsk_window {
+	pgoff_t first;				/* page index of pages[0] */
+	unsigned int nr;
+	unsigned long missing;			/* writes: no page yet */
+	unsigned long shared;			/* writes: page shared with a clone */
+	unsigned long skip;			/* writes: all-zero page, elided */
+	struct page *pages[RDSK_BIO_WINDOW];
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,18,0)
+#define rdsk_nth_page(page, n)	((page) + (n))
+#else
+#define rdsk_nth_page(page, n)	nth_page(page, n)
+#endif
+
+static inline bool rdsk_bulk_io(struct rdsk_device *rdsk)
+{
+	return !rdsk->page_order && rdsk->comp_algo == RDSK_COMP_NONE;
+}
+
+static unsigned long rdsk_alloc_pages_bulk(struct rdsk_device *rdsk, pgoff_t idx, gfp_t gfp,
+					   unsigned long nr, struct page **pages)
+{
+	int nid = rdsk_page_node(rdsk, idx);
+	unsigned long i = 0, taken = 0;
+
+	/* The reservation is used up before the page allocator is asked. */
+	if (rdsk_has_pool(rdsk)) {
+		for (; i < nr; i++) {
+			if (pages[i])
+				continue;
+			pages[i] = rdsk_pool_get(rdsk->pool, gfp);
+			if (!pages[i])
+				break;
+			taken++;
+		}
+		this_cpu_add(rdsk->stats->pool_allocs, taken);
+		if (i == nr)
+			return nr;
+	}
+
+	/* Interleaved pages each go to their own node; leave them to the caller. */
+	if (rdsk->numa_policy == RDSK_NUMA_INTERLEAVE)
+		return i;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,14,0)
+	if (nid == NUMA_NO_NODE)
+		return alloc_pages_bulk(gfp, nr, pages);
+	return alloc_pages_bulk_node(gfp | __GFP_THISNODE, nid, nr, pages);
+#else
+	if (nid == NUMA_NO_NODE)
+		return alloc_pages_bulk_array(gfp, nr, pages);
+	return alloc_pages_bulk_array_node(gfp | __GFP_THISNODE, nid, nr, pages);
+#endif
+}
+
+/*
+ * Drop the pages of the window that the write fully covers with zeros
+ * instead of storing them, as rdsk_do_bvec() does for single pages. iter
+ * is positioned at byte pos of the device and end is where the bio ends.
+ */
+static void rdsk_window_elide(struct rdsk_device *rdsk, struct rdsk_window *w, struct bio *bio,
+			      struct bvec_iter *iter, u64 pos, u64 end, gfp_t gfp)
+{
+	u64 wend = min_t(u64, end, (u64)(w->first + w->nr) << PAGE_SHIFT);
+	unsigned long zero = 0;
+	struct bvec_iter it;
+	struct bio_vec bv;
+	unsigned int i;
+
+	for (i = 0; i < w->nr; i++) {
+		u64 start = (u64)(w->first + i) << PAGE_SHIFT;
+
+		if (start >= pos && start + PAGE_SIZE <= end)
+			zero |= BIT(i);
+	}
+	if (!zero)
+		return;
+
+	it = *iter;
+	it.bi_size = wend - pos;
+	__bio_for_each_segment(bv, bio, it, it) {
+		void *mem = kmap_local_page(bv.bv_page);
+		bool nonzero = memchr_inv(mem + bv.bv_offset, 0, bv.bv_len);
+
+		kunmap_local(mem);
+		if (nonzero) {
+			pgoff_t a = (pos >> PAGE_SHIFT) - w->first;
+			pgoff_t b = ((pos + bv.bv_len - 1) >> PAGE_SHIFT) - w->first;
+
+			for (i = a; i <= b; i++)
+				zero &= ~BIT(i);
+		}
+		pos += bv.bv_len;
+	}
+
+	for_each_set_bit(i, &zero, w->nr)
+		if (rdsk_erase_page(rdsk, (sector_t)(w->first + i) << PAGE_SECTORS_SHIFT, gfp)) {
+			w->skip |= BIT(i);
+			this_cpu_inc(rdsk->stats->zero_elided);
+		}
+}
+
+/*
+ * Enter and leave the section in which the pages of window w are used. On a
+ * movable device, this also holds off the migration of pages in its shard.
+ */
+static inline void rdsk_window_lock(struct rdsk_device *rdsk, struct rdsk_window *w)
+{
+	rcu_read_lock();
+#ifdef RDSK_MOVABLE
+	if (rdsk->movable)
+		read_lock(&rdsk_shard(rdsk, w->first)->mig_lock);
+#endif
+}
+
+static inline void rdsk_window_unlock(struct rdsk_device *rdsk, struct rdsk_window *w)
+{
+#ifdef RDSK_MOVABLE
+	if (rdsk->movable)
+		read_unlock(&rdsk_shard(rdsk, w->first)->mig_lock);
+#endif
+	rcu_read_unlock();
+}
+
+/* Resolve the pages of the window in one walk. Called under rdsk_window_lock(). */
+static void rdsk_window_walk(struct rdsk_device *rdsk, struct rdsk_window *w, bool is_write)
+{
+	XA_STATE(xas, &rdsk_shard(rdsk, w->first)->pages, w->first);
+	struct page *page;
+	unsigned int i;
+
+	memset(w->pages, 0, w->nr * sizeof(w->pages[0]));
+	xas_for_each(&xas, page, w->first + w->nr - 1) {
+		if (xas_retry(&xas, page))
+			continue;
+		w->pages[xas.xa_index - w->first] = page;
+	}
+
+	w->missing = w->shared = 0;
+	if (!is_write)
+		return;
+	for (i = 0; i < w->nr; i++) {
+		if (w->skip & BIT(i))
+			continue;
+		if (!w->pages[i])
+			w->missing |= BIT(i);
+		else if (rdsk->cow && rdsk_page_shared(w->pages[i]))
+			w->shared |= BIT(i);
+	}
+}
+
+/* Allocate and install the missing pages of the window and unshare the shared ones. */
+static int rdsk_window_fill(struct rdsk_device *rdsk, struct rdsk_window *w, gfp_t gfp)
+{
+	XA_STATE(xas, &rdsk_shard(rdsk, w->first)->pages, w->first);
+	struct page *new[RDSK_BIO_WINDOW] = { NULL };
+	unsigned int i, j, nr = hweight_long(w->missing);
+	unsigned long installed = 0;
+	gfp_t gfp_flags = gfp | __GFP_ZERO | __GFP_NOWARN | __GFP_HIGHMEM;
+
+	for_each_set_bit(i, &w->shared, w->nr)
+		if (rdsk_make_private(rdsk, (sector_t)(w->first + i) << PAGE_SECTORS_SHIFT, gfp))
+			return -ENOSPC;
+	if (!nr)
+		return SUCCESS;
+
+	/* Same placement rules as rdsk_insert_page(). */
+	if (rdsk->movable)
+		gfp_flags |= __GFP_MOVABLE;
+	/* Whatever the bulk allocator could not provide is allocated one by one. */
+	rdsk_alloc_pages_bulk(rdsk, w->first, gfp_flags, nr, new);
+	j = 0;
+	for_each_set_bit(i, &w->missing, w->nr) {
+		if (!new[j])
+			new[j] = rdsk_alloc_pages(rdsk, w->first + i, gfp_flags, 0);
+		if (!new[j]) {
+			j = 0;
+			goto out_nomem;
+		}
+		rdsk_set_page_index(new[j], w->first + i);
+		j++;
+	}
+
+	i = j = 0;
+	do {
+		xas_lock(&xas);
+		for (; i < w->nr; i++) {
+			if (!(w->missing & BIT(i)))
+				continue;
+			xas_set(&xas, w->first + i);
+			/* Lost a race with another writer; the next walk finds their page. */
+			if (xas_load(&xas)) {
+				rdsk_free_new_page(rdsk, new[j++]);
+				continue;
+			}
+			xas_store(&xas, new[j]);
+			if (xas_error(&xas))
+				break;
+			rdsk_mark_movable(rdsk, new[j]);
+			rdsk_count_node(rdsk, new[j++], 1);
+			installed++;
+		}
+		xas_unlock(&xas);
+	} while (xas_nomem(&xas, gfp));
+	rdsk_count_pages(rdsk, installed);
+	if (!xas_error(&xas))
+		return SUCCESS;
+
+out_nomem:
+	for (; j < nr; j++)
+		if (new[j])
+			rdsk_free_new_page(rdsk, new[j]);
+	rdsk_count_alloc_fail(rdsk, w->first);
+	return -ENOSPC;
+}
+
+/*
+ * Set up the window starting at byte pos of the device, with iter positioned
+ * there. Returns under rdsk_window_lock(), which keeps the pages valid
+ * until the window has been copied.
+ */
+static int rdsk_window_get(struct rdsk_device *rdsk, struct rdsk_window *w, struct bio *bio,
+			   struct bvec_iter *iter, u64 pos, u64 end, bool is_write, gfp_t gfp)
+{
+	pgoff_t first = pos >> PAGE_SHIFT;
+	pgoff_t last = (end - 1) >> PAGE_SHIFT;
+	int err;
+
+	last = min(last, first | ((1UL << RDSK_SHARD_SHIFT) - 1));
+	w->first = first;
+	w->nr = min_t(pgoff_t, last - first + 1, RDSK_BIO_WINDOW);
+	w->skip = 0;
+	if (is_write && rdsk_can_free_pages(rdsk))
+		rdsk_window_elide(rdsk, w, bio, iter, pos, end, gfp);
+
+	rdsk_window_lock(rdsk, w);
+	rdsk_window_walk(rdsk, w, is_write);
+	if (!(w->missing | w->shared))
+		return SUCCESS;
+	rdsk_window_unlock(rdsk, w);
+
+	err = rdsk_window_fill(rdsk, w, gfp);
+	if (err)
+		return err;
+	/*
+	 * A page erased again by a racing zero page write or discard stays a
+	 * hole; that write is simply ordered after this one.
+	 */
+	rdsk_window_lock(rdsk, w);
+	rdsk_window_walk(rdsk, w, is_write);
+	return SUCCESS;
+}
+
+/*
+ * Large writes on a device with an nt_threshold are stored with non-temporal
+ * stores, so that streaming data does not evict the working set of other
+ * tasks from the CPU caches. Reads keep using memcpy(), since the reader is
+ * about to touch the data anyway.
+ */
+static int rdsk_do_bio(struct rdsk_device *rdsk, struct bio *bio, gfp_t gfp)
+{
+	bool is_write = op_is_write(bio_op(bio));
+	bool nt = is_write && rdsk->nt_threshold && bio->bi_iter.bi_size >= rdsk->nt_threshold;
+	u64 start = (u64)bio->bi_iter.bi_sector << SECTOR_SHIFT;
+	u64 end = start + bio->bi_iter.bi_size, pos = start;
+	struct rdsk_window w = { .nr = 0 };
+	struct bvec_iter iter;
+	struct bio_vec bv;
+	int err = SUCCESS;
+
+	bio_for_each_bvec(bv, bio, iter) {
+		unsigned int done = 0;
+
+		while (done < bv.bv_len) {
+			unsigned int boff = bv.bv_offset + done;
+			struct page *bpage = rdsk_nth_page(bv.bv_page, boff >> PAGE_SHIFT);
+			unsigned int off = pos & ~PAGE_MASK;
+			unsigned int slot, len;
+			struct page *page;
+			void *mem;
+
+			if (!w.nr || (pos >> PAGE_SHIFT) >= w.first + w.nr) {
+				struct bvec_iter it = iter;
+
+				if (w.nr)
+					rdsk_window_unlock(rdsk, &w);
+				bio_advance_iter(bio, &it, done);
+				err = rdsk_window_get(rdsk, &w, bio, &it, pos, end, is_write, gfp);
+				if (err) {
+					w.nr = 0;
+					goto out;
+				}
+			}
+
+			slot = (pos >> PAGE_SHIFT) - w.first;
+			boff = offset_in_page(boff);
+			len = min3(bv.bv_len - done, (unsigned int)PAGE_SIZE - off,
+				   (unsigned int)PAGE_SIZE - boff);
+			page = w.pages[slot];
+			mem = kmap_local_page(bpage);
+			if (!is_write) {
+				if (page)
+					memcpy_from_page(mem + boff, page, off, len);
+				else
+					memset(mem + boff, 0, len);
+				flush_dcache_page(bpage);
+			} else if (page && !(w.skip & BIT(slot))) {
+				flush_dcache_page(bpage);
+				if (nt) {
+					void *dst = kmap_local_page(page);
+
+					memcpy_flushcache(dst + off, mem + boff, len);
+					kunmap_local(dst);
+				} else {
+					memcpy_to_page(page, off, mem + boff, len);
+				}
+			}
+			kunmap_local(mem);
+
+			done += len;
+			pos += len;
+		}
+	}
+
+out:
+	if (w.nr)
+		rdsk_window_unlock(rdsk, &w);
+	if (is_write && pos > start) {
+		/* Non-temporal stores are weakly ordered; drain them before completion. */
+		if (nt) {
+			wmb();
+			this_cpu_add(rdsk->stats->nt_bytes, pos - start);
+		}
+		rdsk_note_written(rdsk, pos >> SECTOR_SHIFT);
+#ifdef RDSK_MIRROR
+		rdsk_mirror_dirty(rdsk, start >> SECTOR_SHIFT, pos - start);
+#endif
+	}
+	return err;
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0) || (defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
+static void
+#else
+static blk_qc_t
+#endif
+#else
+static void
+#endif
+#else
+static int
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+rdsk_submit_bio(struct bio *bio)
+#else
+rdsk_make_request(struct request_queue *q, struct bio *bio)
+#endif
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)) && (LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0))
+	struct rdsk_device *rdsk = bio->bi_disk->private_data;
+#else
+	struct block_device *bdev = bio->bi_bdev;
+	struct rdsk_device *rdsk = bdev->bd_disk->private_data;
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
+	int rw;
+#endif
+	sector_t sector, first;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+#else
+	struct bio_vec *bvec;
+	int i;
+#endif
+	int err = -EIO;
+	unsigned int bytes;
+	u64 start_ns = ktime_get_ns();
+	gfp_t gfp = GFP_NOIO;
+#ifdef RDSK_IO_ACCT
+	unsigned long acct_start = 0;
+	bool acct = false;
+#endif
+#ifdef RDSK_ZONED
+	bool zone_wp = false;		/* the write pointer was advanced past this write */
+#endif
+#ifdef RDSK_NOWAIT
+	bool nowait = bio->bi_opf & REQ_NOWAIT;
+
+	/* Allocate without sleeping; the submitter retries if that fails. */
+	if (nowait)
+		gfp = GFP_NOWAIT | __GFP_NOWARN;
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+	sector = bio->bi_iter.bi_sector;
+	bytes = bio->bi_iter.bi_size;
+#else
+	sector = bio->bi_sector;
+	bytes = bio->bi_size;
+#endif
+#ifdef RDSK_ZONED
+	/* Writes are held back until they are at the zone's write pointer. */
+	if (rdsk->zoned && blk_zone_plug_bio(bio, 0))
+		return;
+#endif
+	first = sector;
+	trace_rapiddisk_submit(rdsk->num, sector, bytes, rdsk_bio_op_name(bio));
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)) && (LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0))
+	if ((sector + bio_sectors(bio)) > get_capacity(bio->bi_disk))
+#else
+	if ((sector + bio_sectors(bio)) > get_capacity(bdev->bd_disk))
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,3,0)
+		goto out;
+#else
+		goto io_error;
+#endif
+
+	err = SUCCESS;
+#ifdef RDSK_ZONED
+	if (rdsk->zoned) {
+		blk_status_t sts = BLK_STS_OK;
+
+		if (op_is_zone_mgmt(bio_op(bio)))
+			sts = rdsk_zone_mgmt(rdsk, bio);
+		else if (op_is_write(bio_op(bio))) {
+			sts = rdsk_zone_write(rdsk, bio);
+			zone_wp = sts == BLK_STS_OK;
+		}
+		if (sts != BLK_STS_OK || op_is_zone_mgmt(bio_op(bio))) {
+			if (sts != BLK_STS_OK)
+				rdsk_count_error(rdsk);
+			trace_rapiddisk_complete(rdsk->num, first, bytes, rdsk_bio_op_name(bio),
+						 blk_status_to_errno(sts), ktime_get_ns() - start_ns);
+			bio->bi_status = sts;
+			bio_endio(bio);
+			return;
+		}
+		/* A zone append reports where the data actually landed. */
+		sector = first = bio->bi_iter.bi_sector;
+	}
+#endif
+#ifdef RDSK_IO_ACCT
+	/* Feed /proc/diskstats and iostat, unless queue/iostats has been turned off. */
+	if (blk_queue_io_stat(rdsk->rdsk_disk->queue)) {
+		acct_start = bio_start_io_acct(bio);
+		acct = true;
+	}
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	if ((unlikely(bio_op(bio) == REQ_OP_DISCARD)) || (unlikely(bio_op(bio) == REQ_OP_WRITE_ZEROES))) {
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+	if (unlikely(bio_op(bio) == REQ_OP_DISCARD)) {
+#else
+	if (unlikely(bio->bi_rw & REQ_DISCARD)) {
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0)
+		bool unmap = !(bio->bi_opf & REQ_NOUNMAP);
+#else
+		bool unmap = true;
+#endif
+
+#ifdef RDSK_NOWAIT
+		/* Unlinking pages allocates the batches that free them, which may sleep. */
+		if (nowait)
+			goto would_block;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+		err = discard_from_rdsk(rdsk, sector, bio->bi_iter.bi_size, unmap);
+#else
+		err = discard_from_rdsk(rdsk, sector, bio->bi_size, unmap);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+		if (err) {
+			rdsk_count_error(rdsk);
+			goto io_error;
+		}
+#else
+		if (err)
+			rdsk_count_error(rdsk);
+#endif
+		goto out;
+	}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
+	rw = bio_rw(bio);
+	if (rw == READA)
+		rw = READ;
+#endif
+
+#ifdef RDSK_BULK_IO
+	if (rdsk_bulk_io(rdsk)) {
+		err = rdsk_do_bio(rdsk, bio, gfp);
+		if (err) {
+#ifdef RDSK_NOWAIT
+			if (nowait && err == -ENOSPC)
+				goto would_block;
+#endif
+			rdsk_count_error(rdsk);
+			goto io_error;
+		}
+		goto out;
+	}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+	bio_for_each_segment(bvec, bio, iter) {
+		unsigned int len = bvec.bv_len;
+
+		err = rdsk_do_bvec(rdsk, bvec.bv_page, len,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+				   bvec.bv_offset, bio_op(bio), sector, gfp);
+#else
+				   bvec.bv_offset, op_is_write(bio_op(bio)), sector, gfp);
+#endif
+#else
+				   bvec.bv_offset, rw, sector, gfp);
+#endif
+#else
+	bio_for_each_segment(bvec, bio, i) {
+		unsigned int len = bvec->bv_len;
+
+		err = rdsk_do_bvec(rdsk, bvec->bv_page, len,
+				   bvec->bv_offset, rw, sector, gfp);
+#endif
+		if (err) {
+#ifdef RDSK_NOWAIT
+			if (nowait && err == -ENOSPC)
+				goto would_block;
+#endif
+			rdsk_count_error(rdsk);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,3,0)
+			break;
+#else
+			goto io_error;
+#endif
+		}
+		sector += len >> SECTOR_SHIFT;
+	}
+
+out:
+	if (!err && bytes)
+		rdsk_account_io(rdsk, rdsk_bio_stat_op(bio), bytes, start_ns);
+	trace_rapiddisk_complete(rdsk->num, first, bytes, rdsk_bio_op_name(bio), err,
+				 ktime_get_ns() - start_ns);
+#ifdef RDSK_IO_ACCT
+	if (acct)
+		bio_end_io_acct(bio, acct_start);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,3,0)
+	set_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio_endio(bio, err);
+#else
+	bio_endio(bio);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0)
+#if  (defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
+	return;
+#else
+	return BLK_QC_T_NONE;
+#endif
+#else
+	return;
+#endif
+#endif
+#ifdef RDSK_NOWAIT
+would_block:
+	/* Not an error; the bio is reissued from a context that may sleep. */
+	this_cpu_inc(rdsk->stats->nowait_again);
+#ifdef RDSK_ZONED
+	if (zone_wp)
+		rdsk_zone_write_undo(rdsk, first, bytes >> SECTOR_SHIFT);
+#endif
+	trace_rapiddisk_complete(rdsk->num, first, bytes, rdsk_bio_op_name(bio), -EAGAIN,
+				 ktime_get_ns() - start_ns);
+#ifdef RDSK_IO_ACCT
+	if (acct)
+		bio_end_io_acct(bio, acct_start);
+#endif
+	bio_wouldblock_error(bio);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0) && !(defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
+	return BLK_QC_T_NONE;
+#else
+	return;
+#endif
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+io_error:
+#ifdef RDSK_ZONED
+	if (zone_wp)
+		rdsk_zone_write_undo(rdsk, first, bytes >> SECTOR_SHIFT);
+#endif
+	trace_rapiddisk_complete(rdsk->num, first, bytes, rdsk_bio_op_name(bio), err,
+				 ktime_get_ns() - start_ns);
+#ifdef RDSK_IO_ACCT
+	if (acct)
+		bio_end_io_acct(bio, acct_start);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	bio->bi_status= err;
+#else
+	bio->bi_error = err;
+#endif
+#endif
+	bio_io_error(bio);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0)
+#if  (defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
+	return;
+#else
+	return BLK_QC_T_NONE;
+#endif
+#endif
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,2,0)
+	return SUCCESS;
+#endif
+}
+
+#ifdef RDSK_BLK_MQ
+static blk_status_t rdsk_handle_rq(struct rdsk_device *rdsk, struct request *rq, gfp_t gfp)
+{
+	struct bio_vec bvec;
+	struct req_iterator iter;
+	sector_t sector = blk_rq_pos(rq);
+	bool is_write = op_is_write(req_op(rq));
+	u64 start_ns = ktime_get_ns();
+	int err;
+
+	switch (req_op(rq)) {
+	case REQ_OP_FLUSH:
+		return BLK_STS_OK;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		/* These may span the whole device; run them where we can reschedule. */
+		if (!gfpflags_allow_blocking(gfp))
+			return BLK_STS_NOSPC;
+		err = discard_from_rdsk(rdsk, sector, blk_rq_bytes(rq), !(rq->cmd_flags & REQ_NOUNMAP));
+		if (err)
+			return errno_to_blk_status(err);
+		rdsk_account_io(rdsk, RDSK_STAT_DISCARD, blk_rq_bytes(rq), start_ns);
+		return BLK_STS_OK;
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+		break;
+	default:
+		return BLK_STS_NOTSUPP;
+	}
+
+	rq_for_each_segment(bvec, rq, iter) {
+		err = rdsk_do_bvec(rdsk, bvec.bv_page, bvec.bv_len,
+				   bvec.bv_offset, is_write, sector, gfp);
+		if (err)
+			return errno_to_blk_status(err);
+		sector += bvec.bv_len >> SECTOR_SHIFT;
+	}
+	rdsk_account_io(rdsk, is_write ? RDSK_STAT_WRITE : RDSK_STAT_READ,
+			blk_rq_bytes(rq), start_ns);
+
+	return BLK_STS_OK;
+}
+
+static inline void rdsk_trace_rq_complete(struct rdsk_device *rdsk, struct request *rq)
+{
+	struct rdsk_mq_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	trace_rapiddisk_complete(rdsk->num, blk_rq_pos(rq), blk_rq_bytes(rq),
+				 rdsk_op_name(req_op(rq)), blk_status_to_errno(cmd->status),
+				 ktime_get_ns() - cmd->start_ns);
+}
+
+/*
+ * A request could not be served without sleeping in the page allocator.
+ * Redo it from process context where GFP_NOIO is allowed. Rewriting the
+ * segments that already made it is harmless.
+ */
+static void rdsk_mq_work(struct work_struct *work)
+{
+	struct rdsk_mq_cmd *cmd = container_of(work, struct rdsk_mq_cmd, work);
+	struct request *rq = blk_mq_rq_from_pdu(cmd);
+	struct rdsk_device *rdsk = rq->q->queuedata;
+
+	cmd->status = rdsk_handle_rq(rdsk, rq, GFP_NOIO);
+	if (cmd->status != BLK_STS_OK)
+		rdsk_count_error(rdsk);
+	rdsk_trace_rq_complete(rdsk, rq);
+	blk_mq_end_request(rq, cmd->status);
+}
+
+static blk_status_t rdsk_queue_rq(struct blk_mq_hw_ctx *hctx,
+				  const struct blk_mq_queue_data *bd)
+{
+	struct request *rq = bd->rq;
+	struct rdsk_mq_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	struct rdsk_device *rdsk = hctx->queue->queuedata;
+	struct rdsk_mq_queue *mq = hctx->driver_data;
+
+	blk_mq_start_request(rq);
+	cmd->start_ns = ktime_get_ns();
+	trace_rapiddisk_submit(rdsk->num, blk_rq_pos(rq), blk_rq_bytes(rq), rdsk_op_name(req_op(rq)));
+
+	/* ->queue_rq() must not sleep, so only allocate if it is free to do so. */
+	cmd->status = rdsk_handle_rq(rdsk, rq, GFP_NOWAIT | __GFP_NOWARN);
+	if (cmd->status == BLK_STS_NOSPC) {
+		queue_work(rdsk_wq, &cmd->work);
+		return BLK_STS_OK;
+	}
+	if (cmd->status != BLK_STS_OK)
+		rdsk_count_error(rdsk);
+	rdsk_trace_rq_complete(rdsk, rq);
+
+	if (hctx->type == HCTX_TYPE_POLL) {
+		spin_lock(&mq->lock);
+		list_add_tail(&rq->queuelist, &mq->poll_list);
+		spin_unlock(&mq->lock);
+		return BLK_STS_OK;
+	}
+
+	blk_mq_end_request(rq, cmd->status);
+	return BLK_STS_OK;
+}
+
+static int rdsk_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+{
+	struct rdsk_mq_queue *mq = hctx->driver_data;
+	LIST_HEAD(list);
+	int nr = 0;
+
+	spin_lock(&mq->lock);
+	list_splice_init(&mq->poll_list, &list);
+	spin_unlock(&mq->lock);
+
+	while (!list_empty(&list)) {
+		struct request *rq = list_first_entry(&list, struct request, queuelist);
+		struct rdsk_mq_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+		list_del_init(&rq->queuelist);
+		if (!blk_mq_add_to_batch(rq, iob, cmd->status != BLK_STS_OK,
+					 blk_mq_end_request_batch))
+			blk_mq_end_request(rq, cmd->status);
+		nr++;
+	}
+
+	return nr;
+}
+
+static int rdsk_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+			  unsigned int hctx_idx)
+{
+	struct rdsk_device *rdsk = data;
+
+	hctx->driver_data = &rdsk->mq_queues[hctx_idx];
+	return SUCCESS;
+}
+
+static int rdsk_init_request(struct blk_mq_tag_set *set, struct request *rq,
+			     unsigned int hctx_idx, unsigned int numa_node)
+{
+	struct rdsk_mq_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	INIT_WORK(&cmd->work, rdsk_mq_work);
+	return SUCCESS;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,2,0)
+static void rdsk_map_queues(struct blk_mq_tag_set *set)
+#else
+static int rdsk_map_queues(struct blk_mq_tag_set *set)
+#endif
+{
+	struct rdsk_device *rdsk = set->driver_data;
+	int i, qoff = 0;
+
+	for (i = 0; i < set->nr_maps; i++) {
+		struct blk_mq_queue_map *map = &set->map[i];
+
+		switch (i) {
+		case HCTX_TYPE_DEFAULT:
+			map->nr_queues = set->nr_hw_queues - rdsk->nr_poll_queues;
+			break;
+		case HCTX_TYPE_POLL:
+			map->nr_queues = rdsk->nr_poll_queues;
+			break;
+		default:
+			/* Reads share the default queues. */
+			map->nr_queues = 0;
+			continue;
+		}
+		map->queue_offset = qoff;
+		qoff += map->nr_queues;
+		blk_mq_map_queues(map);
+	}
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,2,0)
+	return SUCCESS;
+#endif
+}
+
+static const struct blk_mq_ops rdsk_mq_ops = {
+	.queue_rq	= rdsk_queue_rq,
+	.poll		= rdsk_poll,
+	.init_hctx	= rdsk_init_hctx,
+	.init_request	= rdsk_init_request,
+	.map_queues	= rdsk_map_queues,
+};
+
+static struct gendisk *rdsk_mq_alloc_disk(struct rdsk_device *rdsk)
+{
+	struct blk_mq_tag_set *set = &rdsk->tag_set;
+	struct gendisk *disk;
+	int i;
+
+	set->ops = &rdsk_mq_ops;
+	set->nr_hw_queues = nr_cpu_ids + rdsk->nr_poll_queues;
+	set->nr_maps = rdsk->nr_poll_queues ? HCTX_MAX_TYPES : 1;
+	set->queue_depth = nr_requests;
+	set->numa_node = rdsk->numa_policy == RDSK_NUMA_BIND ? rdsk->numa_node : NUMA_NO_NODE;
+	set->cmd_size = sizeof(struct rdsk_mq_cmd);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,14,0)
+	set->flags = BLK_MQ_F_SHOULD_MERGE;
+#endif
+	set->driver_data = rdsk;
+
+	rdsk->mq_queues = kcalloc(set->nr_hw_queues, sizeof(*rdsk->mq_queues), GFP_KERNEL);
+	if (!rdsk->mq_queues)
+		return NULL;
+	for (i = 0; i < set->nr_hw_queues; i++) {
+		spin_lock_init(&rdsk->mq_queues[i].lock);
+		INIT_LIST_HEAD(&rdsk->mq_queues[i].poll_list);
+	}
+
+	if (blk_mq_alloc_tag_set(set))
+		goto out_free_queues;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,9,0)
+	disk = blk_mq_alloc_disk(set, NULL, rdsk);
+#else
+	disk = blk_mq_alloc_disk(set, rdsk);
+#endif
+	if (IS_ERR(disk))
+		goto out_free_tag_set;
+
+	return disk;
+
+out_free_tag_set:
+	blk_mq_free_tag_set(set);
+out_free_queues:
+	kfree(rdsk->mq_queues);
+	return NULL;
+}
+
+static void rdsk_mq_free(struct rdsk_device *rdsk)
+{
+	if (rdsk->queue_mode != RDSK_QUEUE_MQ)
+		return;
+	blk_mq_free_tag_set(&rdsk->tag_set);
+	kfree(rdsk->mq_queues);
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0) || (defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
+static inline int bdev_openers(struct block_device *bdev)
+{
+	return atomic_read(&bdev->bd_openers);
+}
+#else
+static inline int bdev_openers(struct block_device *bdev)
+{
+	return bdev->bd_openers;
+}
+#endif
+
+static int rdsk_ioctl(struct block_device *bdev, fmode_t mode,
+		      unsigned int cmd, unsigned long arg)
+{
+	int error = 0;
+	struct rdsk_device *rdsk = bdev->bd_disk->private_data;
+	unsigned long long usage, max_blk_alloc;
+
+	switch (cmd) {
+	case IOCTL_RD_BLKFLSBUF:
+		/* We are killing the RAM disk data. */
+#ifdef RDSK_MEMDEV
+		mutex_lock(&rdsk->mem_lock);
+		if (rdsk_mem_mapped(rdsk)) {
+			mutex_unlock(&rdsk->mem_lock);
+			return -EBUSY;
+		}
+#endif
+		mutex_lock(&ioctl_mutex);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,14,0)
+		mutex_lock(&bdev->bd_disk->open_mutex);
+#else
+		mutex_lock(&bdev->bd_mutex);
+#endif
+		error = -EBUSY;
+		if (bdev_openers(bdev) <= 1) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0) || (defined(RHEL_MAJOR) && RHEL_MAJOR == 8 && RHEL_MINOR >= 4)
+			invalidate_bdev(bdev);
+#else
+			kill_bdev(bdev);
+#endif
+#else
+			invalidate_bh_lrus();
+			truncate_inode_pages(bdev->bd_inode->i_mapping, 0);
+#endif
+#ifdef RDSK_MIRROR
+			/* The mirror thread copies pages outside of the I/O path. */
+			if (rdsk->mirror) {
+				mutex_lock(&rdsk->mirror->lock);
+				rdsk_flush_pages(rdsk);
+				rdsk_mirror_reset(rdsk);
+				mutex_unlock(&rdsk->mirror->lock);
+			} else
+#endif
+			rdsk_flush_pages(rdsk);
+			error = 0;
+		}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,14,0)
+		mutex_unlock(&bdev->bd_disk->open_mutex);
+#else
+		mutex_unlock(&bdev->bd_mutex);
+#endif
+		atomic64_set(&rdsk->max_blk_alloc, 0);
+		/* Keep the guarantee that a preallocated device never allocates. */
+		if (!error && rdsk->prealloc &&
+		    rdsk_populate(rdsk, 0, DIV_ROUND_UP(rdsk->size, PAGE_SIZE),
+				  GFP_NOIO | __GFP_NOWARN) != SUCCESS)
+			pr_warn("%s: rd%d is no longer fully preallocated.\n", PREFIX, rdsk->num);
+#ifdef RDSK_RESERVE
+		/* The flushed pages went back to the system, not to the pool. */
+		if (!error && rdsk->pool && rdsk_pool_fill(rdsk, GFP_NOIO) != SUCCESS)
+			pr_warn("%s: rd%d no longer holds its full reservation.\n", PREFIX, rdsk->num);
+#endif
+		mutex_unlock(&ioctl_mutex);
+#ifdef RDSK_MEMDEV
+		mutex_unlock(&rdsk->mem_lock);
+#endif
+		return error;
+	case IOCTL_INVALID_CDQUERY:
+	case IOCTL_INVALID_CDQUERY2:
+	case IOCTL_INVALID_TTY:
+	case IOCTL_INVALID_SG_IO:
+		return -EINVAL;
+	case IOCTL_RD_GET_STATS:
+		max_blk_alloc = atomic64_read(&rdsk->max_blk_alloc);
+		return copy_to_user((void __user *)arg,
+			&max_blk_alloc,
+			sizeof(max_blk_alloc)) ? -EFAULT : 0;
+	case IOCTL_RD_GET_USAGE:
+		usage = rdsk_used_pages(rdsk);
+		return copy_to_user((void __user *)arg,
+			&usage, sizeof(usage)) ? -EFAULT : 0;
+	}
+
+	pr_warn("%s: 0x%x invalid ioctl.\n", PREFIX, cmd);
+	return -ENOTTY;		/* unknown command */
+}
+
+static const struct block_device_operations rdsk_fops = {
+	.owner = THIS_MODULE,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+	.submit_bio = rdsk_submit_bio,
+#endif
+	.ioctl = rdsk_ioctl,
+#ifdef RDSK_ZONED
+	.report_zones = rdsk_report_zones,
+#endif
+};
+
+#ifdef RDSK_BLK_MQ
+/* blk-mq devices must not provide ->submit_bio. */
+static const struct block_device_operations rdsk_mq_fops = {
+	.owner = THIS_MODULE,
+	.ioctl = rdsk_ioctl,
+};
+#endif
 
-static int copy_to_rdsk_setup(struct rdsk_device *rdsk,
-			      sector_t sector, size_t n)
+#ifdef RDSK_MEMDEV
+/*
+ * /dev/rdN_mem maps the pages backing rdN into user space, allocating them
+ * on first touch just like a write would. Block I/O and the mapping then
+ * operate on the very same memory. Nothing may take a page out of the index
+ * while it could be mapped, so flush, shrink and clone are refused and pages
+ * are no longer released by zero page elision or discard while a mapping
+ * exists, and detach is refused while the character device is open.
+ */
+static int rdsk_mem_open(struct inode *inode, struct file *filp)
 {
-	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
-	size_t copy;
+	struct rdsk_device *rdsk = container_of(filp->private_data, struct rdsk_device, mem_dev);
+	int err = 0;
 
-	copy = min_t(size_t, n, PAGE_SIZE - offset);
-	if (!rdsk_insert_page(rdsk, sector))
-		return -ENOSPC;
-	if (copy < n) {
-		sector += copy >> SECTOR_SHIFT;
-		if (!rdsk_insert_page(rdsk, sector))
-			return -ENOSPC;
-	}
-	return SUCCESS;
+	mutex_lock(&rdsk->mem_lock);
+	if (rdsk->mem_gone)
+		err = -ENODEV;
+	else
+		rdsk->mem_users++;
+	mutex_unlock(&rdsk->mem_lock);
+	filp->private_data = rdsk;
+	return err;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
-static void discard_from_rdsk(struct rdsk_device *rdsk,
-			      sector_t sector, size_t n)
+static int rdsk_mem_release(struct inode *inode, struct file *filp)
 {
-	while (n >= PAGE_SIZE) {
-		rdsk_zero_page(rdsk, sector);
-		sector += PAGE_SIZE >> SECTOR_SHIFT;
-		n -= PAGE_SIZE;
-	}
+	struct rdsk_device *rdsk = filp->private_data;
+
+	mutex_lock(&rdsk->mem_lock);
+	rdsk->mem_users--;
+	mutex_unlock(&rdsk->mem_lock);
+	return 0;
 }
-#endif
 
-static void copy_to_rdsk(struct rdsk_device *rdsk, const void *src,
-			 sector_t sector, size_t n)
+static void rdsk_mem_vm_open(struct vm_area_struct *vma)
 {
-	struct page *page;
-	void *dst;
-	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
-	size_t copy;
-
-	copy = min_t(size_t, n, PAGE_SIZE - offset);
-	page = rdsk_lookup_page(rdsk, sector);
-	BUG_ON(!page);
+	struct rdsk_device *rdsk = vma->vm_private_data;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
-	dst = kmap_atomic(page);
-#else
-	dst = kmap_atomic(page, KM_USER1);
-#endif
-	memcpy(dst + offset, src, copy);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
-	kunmap_atomic(dst);
-#else
-	kunmap_atomic(dst, KM_USER1);
-#endif
+	atomic_inc(&rdsk->mem_maps);
+}
 
-	if (copy < n) {
-		src += copy;
-		sector += copy >> SECTOR_SHIFT;
-		copy = n - copy;
-		page = rdsk_lookup_page(rdsk, sector);
-		BUG_ON(!page);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
-		dst = kmap_atomic(page);
-#else
-		dst = kmap_atomic(page, KM_USER1);
-#endif
-		memcpy(dst, src, copy);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
-		kunmap_atomic(dst);
-#else
-		kunmap_atomic(dst, KM_USER1);
-#endif
-	}
+static void rdsk_mem_vm_close(struct vm_area_struct *vma)
+{
+	struct rdsk_device *rdsk = vma->vm_private_data;
 
-	if ((sector + (n / BYTES_PER_SECTOR)) > rdsk->max_blk_alloc)
-		rdsk->max_blk_alloc = (sector + (n / BYTES_PER_SECTOR));
+	atomic_dec(&rdsk->mem_maps);
 }
 
-static void copy_from_rdsk(void *dst, struct rdsk_device *rdsk,
-			   sector_t sector, size_t n)
+static vm_fault_t rdsk_mem_fault(struct vm_fault *vmf)
 {
+	struct rdsk_device *rdsk = vmf->vma->vm_private_data;
+	sector_t sector = (sector_t)vmf->pgoff << PAGE_SECTORS_SHIFT;
 	struct page *page;
-	void *src;
-	unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
-	size_t copy;
 
-	copy = min_t(size_t, n, PAGE_SIZE - offset);
-	page = rdsk_lookup_page(rdsk, sector);
+	if (sector >= get_capacity(rdsk->rdsk_disk))
+		return VM_FAULT_SIGBUS;
+	page = rdsk_insert_page(rdsk, sector, GFP_NOIO);
+	if (!page)
+		return VM_FAULT_OOM;
+	/* The index keeps its own reference; this one belongs to the page table. */
+	get_page(page);
+	vmf->page = page;
+	return 0;
+}
 
-	if (page) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
-		src = kmap_atomic(page);
-#else
-		src = kmap_atomic(page, KM_USER1);
+static const struct vm_operations_struct rdsk_mem_vm_ops = {
+	.open = rdsk_mem_vm_open,
+	.close = rdsk_mem_vm_close,
+	.fault = rdsk_mem_fault,
+};
+
+static int rdsk_mem_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct rdsk_device *rdsk = filp->private_data;
+	unsigned long pages = DIV_ROUND_UP(rdsk->size, PAGE_SIZE);
+	unsigned int memflags;
+	int err = 0;
+
+	if (vma->vm_pgoff >= pages || vma_pages(vma) > pages - vma->vm_pgoff)
+		return -EINVAL;
+
+	mutex_lock(&rdsk->mem_lock);
+	/*
+	 * Stores through a mapping bypass copy on write, the mirror's dirty
+	 * tracking and the zone write pointers, and compressed devices have no
+	 * pages to map in the first place. Movable pages cannot be migrated
+	 * once they are mapped into user space.
+	 */
+	if (rdsk->cow || rdsk->movable || rdsk->comp_algo != RDSK_COMP_NONE)
+		err = -EOPNOTSUPP;
+#ifdef RDSK_MIRROR
+	if (rdsk->mirror)
+		err = -EOPNOTSUPP;
 #endif
-		memcpy(dst, src + offset, copy);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
-		kunmap_atomic(src);
-#else
-		kunmap_atomic(src, KM_USER1);
+#ifdef RDSK_ZONED
+	if (rdsk->zoned)
+		err = -EOPNOTSUPP;
 #endif
-	} else {
-		memset(dst, 0, copy);
+	if (!err && atomic_inc_return(&rdsk->mem_maps) == 1) {
+		/* Let I/O that may still be dropping pages finish. */
+		memflags = rdsk_freeze(rdsk);
+		rdsk_unfreeze(rdsk, memflags);
 	}
+	mutex_unlock(&rdsk->mem_lock);
+	if (err)
+		return err;
 
-	if (copy < n) {
-		dst += copy;
-		sector += copy >> SECTOR_SHIFT;
-		copy = n - copy;
-		page = rdsk_lookup_page(rdsk, sector);
-		if (page) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
-			src = kmap_atomic(page);
+	vma->vm_ops = &rdsk_mem_vm_ops;
+	vma->vm_private_data = rdsk;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
 #else
-			src = kmap_atomic(page, KM_USER1);
-#endif
-			memcpy(dst, src, copy);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
-			kunmap_atomic(src);
-#else
-			kunmap_atomic(src, KM_USER1);
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
 #endif
-		} else {
-			memset(dst, 0, copy);
-		}
-	}
+	return 0;
 }
 
-static int rdsk_do_bvec(struct rdsk_device *rdsk, struct page *page,
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
-			unsigned int len, unsigned int off, bool is_write,
-#else
-			unsigned int len, unsigned int off, int rw,
-#endif
-			sector_t sector){
-	void *mem;
-	int err = SUCCESS;
+static const struct file_operations rdsk_mem_fops = {
+	.owner = THIS_MODULE,
+	.open = rdsk_mem_open,
+	.release = rdsk_mem_release,
+	.mmap = rdsk_mem_mmap,
+	.llseek = noop_llseek,
+};
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
-	if (is_write) {
-#else
-	if (rw != READ) {
-#endif
-		err = copy_to_rdsk_setup(rdsk, sector, len);
-		if (err)
-			goto out;
-	}
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
-	mem = kmap_atomic(page);
-#else
-	mem = kmap_atomic(page, KM_USER0);
-#endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
-	if (!is_write) {
-#else
-	if (rw == READ) {
-#endif
-		copy_from_rdsk(mem + off, rdsk, sector, len);
-		flush_dcache_page(page);
-	} else {
-		flush_dcache_page(page);
-		copy_to_rdsk(rdsk, mem + off, sector, len);
+/* A device that cannot be mapped is still usable, so failing here is not fatal. */
+static void rdsk_mem_register(struct rdsk_device *rdsk)
+{
+	snprintf(rdsk->mem_name, sizeof(rdsk->mem_name), "rd%d_mem", rdsk->num);
+	rdsk->mem_dev.minor = MISC_DYNAMIC_MINOR;
+	rdsk->mem_dev.name = rdsk->mem_name;
+	rdsk->mem_dev.fops = &rdsk_mem_fops;
+	if (misc_register(&rdsk->mem_dev)) {
+		pr_warn("%s: Unable to register /dev/%s.\n", PREFIX, rdsk->mem_name);
+		rdsk->mem_gone = true;
 	}
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
-	kunmap_atomic(mem);
-#else
-	kunmap_atomic(mem, KM_USER0);
-#endif
-out:
-	return err;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0)
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0) || (defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
-static void
-#else
-static blk_qc_t
-#endif
-#else
-static void
-#endif
-#else
-static int
-#endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
-rdsk_submit_bio(struct bio *bio)
-#else
-rdsk_make_request(struct request_queue *q, struct bio *bio)
-#endif
+/* Returns -EBUSY if /dev/rdN_mem is still open (or mapped). */
+static int rdsk_mem_unregister(struct rdsk_device *rdsk)
 {
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)) && (LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0))
-	struct rdsk_device *rdsk = bio->bi_disk->private_data;
-#else
-	struct block_device *bdev = bio->bi_bdev;
-	struct rdsk_device *rdsk = bdev->bd_disk->private_data;
-#endif
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
-	int rw;
-#endif
-	sector_t sector;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
-	struct bio_vec bvec;
-	struct bvec_iter iter;
-#else
-	struct bio_vec *bvec;
-	int i;
-#endif
-	int err = -EIO;
+	bool registered;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
-	sector = bio->bi_iter.bi_sector;
-#else
-	sector = bio->bi_sector;
-#endif
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)) && (LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0))
-	if ((sector + bio_sectors(bio)) > get_capacity(bio->bi_disk))
-#else
-	if ((sector + bio_sectors(bio)) > get_capacity(bdev->bd_disk))
-#endif
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,3,0)
-		goto out;
-#else
-		goto io_error;
-#endif
+	mutex_lock(&rdsk->mem_lock);
+	if (rdsk->mem_users) {
+		mutex_unlock(&rdsk->mem_lock);
+		return -EBUSY;
+	}
+	registered = !rdsk->mem_gone;
+	rdsk->mem_gone = true;
+	mutex_unlock(&rdsk->mem_lock);
 
-	err = SUCCESS;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,336)
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
-	if (unlikely(bio_op(bio) == REQ_OP_DISCARD)) {
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0)
-	if ((unlikely(bio_op(bio) == REQ_OP_DISCARD)) || (unlikely(bio_op(bio) == REQ_OP_WRITE_ZEROES))) {
-#else
-	if (unlikely(bio->bi_rw & REQ_DISCARD)) {
-#endif
-		if (sector & ((PAGE_SIZE >> SECTOR_SHIFT) - 1) ||
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
-		    bio->bi_iter.bi_size & ~PAGE_MASK)
-#else
-		    bio->bi_size & ~PAGE_MASK)
-#endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
-		goto io_error;
-#else
-		goto out;
+	if (registered)
+		misc_deregister(&rdsk->mem_dev);
+	return SUCCESS;
+}
 #endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
-		discard_from_rdsk(rdsk, sector, bio->bi_iter.bi_size);
-#else
-		discard_from_rdsk(rdsk, sector, bio->bi_size);
+
+static int rdsk_parse_options(struct rdsk_device *rdsk, char *opts)
+{
+	unsigned int mirror_rate = 0;
+#ifdef RDSK_BLK_MQ
+	bool poll_queues = false;
 #endif
-		goto out;
-	}
+#ifdef RDSK_ZONED
+	unsigned long long zone_size = RDSK_ZONE_SIZE;
+	unsigned int zone_nr_conv = 0, zone_max_open = 0, zone_max_active = 0;
+	bool zoned = false;
 #endif
+	char *opt;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
-	rw = bio_rw(bio);
-	if (rw == READA)
-		rw = READ;
-#endif
+	while ((opt = strsep(&opts, " \t\n")) != NULL) {
+		if (!*opt)
+			continue;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
-	bio_for_each_segment(bvec, bio, iter) {
-		unsigned int len = bvec.bv_len;
+		if (!strncmp(opt, "folio=", 6)) {
+			unsigned long long chunk = memparse(opt + 6, NULL);
 
-		err = rdsk_do_bvec(rdsk, bvec.bv_page, len,
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
-				   bvec.bv_offset, bio_op(bio), sector);
+			if (chunk < PAGE_SIZE || !is_power_of_2(chunk) ||
+			    ilog2(chunk >> PAGE_SHIFT) > RDSK_SHARD_SHIFT) {
+				pr_err("%s: Invalid folio size %s. Must be a power of two between %lu and %lu bytes.\n",
+				       PREFIX, opt + 6, PAGE_SIZE, PAGE_SIZE << RDSK_SHARD_SHIFT);
+				return GENERIC_ERROR;
+			}
+#ifdef RDSK_LARGE_FOLIOS
+			rdsk->page_order = ilog2(chunk >> PAGE_SHIFT);
 #else
-				   bvec.bv_offset, op_is_write(bio_op(bio)), sector);
+			if (chunk != PAGE_SIZE) {
+				pr_err("%s: Large folio backing is not supported on this kernel.\n", PREFIX);
+				return GENERIC_ERROR;
+			}
 #endif
+		} else if (!strcmp(opt, "prealloc")) {
+			rdsk->prealloc = true;
+		} else if (!strcmp(opt, "numa=local")) {
+			rdsk->numa_policy = RDSK_NUMA_LOCAL;
+		} else if (!strcmp(opt, "numa=interleave")) {
+			rdsk->numa_policy = RDSK_NUMA_INTERLEAVE;
+		} else if (!strncmp(opt, "numa=bind:", 10)) {
+			if (kstrtoint(opt + 10, 0, &rdsk->numa_node) || rdsk->numa_node < 0 ||
+			    rdsk->numa_node >= nr_node_ids || !node_state(rdsk->numa_node, N_MEMORY)) {
+				pr_err("%s: Invalid NUMA node: %s\n", PREFIX, opt + 10);
+				return GENERIC_ERROR;
+			}
+			rdsk->numa_policy = RDSK_NUMA_BIND;
+		} else if (!strcmp(opt, "compress=lz4")) {
+#ifdef RDSK_LZ4
+			rdsk->comp_algo = RDSK_COMP_LZ4;
 #else
-				   bvec.bv_offset, rw, sector);
+			pr_err("%s: LZ4 compression is not supported on this kernel.\n", PREFIX);
+			return GENERIC_ERROR;
 #endif
+		} else if (!strcmp(opt, "compress=zstd")) {
+#ifdef RDSK_ZSTD
+			rdsk->comp_algo = RDSK_COMP_ZSTD;
 #else
-	bio_for_each_segment(bvec, bio, i) {
-		unsigned int len = bvec->bv_len;
-
-		err = rdsk_do_bvec(rdsk, bvec->bv_page, len,
-				   bvec->bv_offset, rw, sector);
-#endif
-		if (err) {
-			rdsk->error_cnt++;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,3,0)
-			break;
-#else
-			goto io_error;
+			pr_err("%s: zstd compression is not supported on this kernel.\n", PREFIX);
+			return GENERIC_ERROR;
 #endif
-		}
-		sector += len >> SECTOR_SHIFT;
-	}
-
-out:
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,3,0)
-	set_bit(BIO_UPTODATE, &bio->bi_flags);
-	bio_endio(bio, err);
+		} else if (!strncmp(opt, "mirror=", 7)) {
+#ifdef RDSK_MIRROR
+			if (opt[7] != '/' || rdsk->mirror) {
+				pr_err("%s: The mirror file must be given once, as an absolute path.\n", PREFIX);
+				return GENERIC_ERROR;
+			}
+			rdsk->mirror = kzalloc(sizeof(*rdsk->mirror), GFP_KERNEL);
+			if (!rdsk->mirror)
+				return GENERIC_ERROR;
+			rdsk->mirror->path = kstrdup(opt + 7, GFP_KERNEL);
+			if (!rdsk->mirror->path)
+				return GENERIC_ERROR;
 #else
-	bio_endio(bio);
+			pr_err("%s: Mirror files are not supported on this kernel.\n", PREFIX);
+			return GENERIC_ERROR;
 #endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0)
-#if  (defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
-	return;
+		} else if (!strncmp(opt, "mirror_rate=", 12)) {
+#ifdef RDSK_MIRROR
+			if (kstrtouint(opt + 12, 0, &mirror_rate)) {
+				pr_err("%s: Invalid mirror rate: %s\n", PREFIX, opt + 12);
+				return GENERIC_ERROR;
+			}
 #else
-	return BLK_QC_T_NONE;
+			pr_err("%s: Mirror files are not supported on this kernel.\n", PREFIX);
+			return GENERIC_ERROR;
 #endif
+		} else if (!strncmp(opt, "nt_threshold=", 13)) {
+#ifdef RDSK_BULK_IO
+			unsigned long long threshold = memparse(opt + 13, NULL);
+
+			if (!threshold || threshold > UINT_MAX) {
+				pr_err("%s: Invalid non-temporal copy threshold: %s\n", PREFIX, opt + 13);
+				return GENERIC_ERROR;
+			}
+			rdsk->nt_threshold = threshold;
 #else
-	return;
-#endif
-#endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
-io_error:
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
-	bio->bi_status= err;
+			pr_err("%s: Non-temporal copies are not supported on this kernel.\n", PREFIX);
+			return GENERIC_ERROR;
+#endif
+		} else if (!strncmp(opt, "reserve=", 8)) {
+#ifdef RDSK_RESERVE
+			unsigned long long reserve = memparse(opt + 8, NULL);
+
+			if (!reserve || reserve > rdsk->size) {
+				pr_err("%s: Invalid reservation: %s. Must be between 1 byte and the device size.\n",
+				       PREFIX, opt + 8);
+				return GENERIC_ERROR;
+			}
+			rdsk->reserve = DIV_ROUND_UP(reserve, PAGE_SIZE);
 #else
-	bio->bi_error = err;
+			pr_err("%s: Reservations are not supported on this kernel.\n", PREFIX);
+			return GENERIC_ERROR;
 #endif
+		} else if (!strcmp(opt, "movable")) {
+#ifdef RDSK_MOVABLE
+			rdsk->movable = true;
+#else
+			pr_err("%s: Movable pages are not supported on this kernel.\n", PREFIX);
+			return GENERIC_ERROR;
 #endif
-	bio_io_error(bio);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0)
-#if  (defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
-	return;
+		} else if (!strcmp(opt, "zoned")) {
+#ifdef RDSK_ZONED
+			zoned = true;
 #else
-	return BLK_QC_T_NONE;
+			pr_err("%s: Zoned mode is not supported on this kernel.\n", PREFIX);
+			return GENERIC_ERROR;
 #endif
+		} else if (!strncmp(opt, "zone_size=", 10)) {
+#ifdef RDSK_ZONED
+			zone_size = memparse(opt + 10, NULL);
 #endif
+		} else if (!strncmp(opt, "zone_nr_conv=", 13)) {
+#ifdef RDSK_ZONED
+			if (kstrtouint(opt + 13, 0, &zone_nr_conv)) {
+				pr_err("%s: Invalid number of conventional zones: %s\n", PREFIX, opt + 13);
+				return GENERIC_ERROR;
+			}
 #endif
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,2,0)
-	return SUCCESS;
+		} else if (!strncmp(opt, "zone_max_open=", 14)) {
+#ifdef RDSK_ZONED
+			if (kstrtouint(opt + 14, 0, &zone_max_open)) {
+				pr_err("%s: Invalid maximum of open zones: %s\n", PREFIX, opt + 14);
+				return GENERIC_ERROR;
+			}
 #endif
-}
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0) || (defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
-static inline int bdev_openers(struct block_device *bdev)
-{
-	return atomic_read(&bdev->bd_openers);
-}
+		} else if (!strncmp(opt, "zone_max_active=", 16)) {
+#ifdef RDSK_ZONED
+			if (kstrtouint(opt + 16, 0, &zone_max_active)) {
+				pr_err("%s: Invalid maximum of active zones: %s\n", PREFIX, opt + 16);
+				return GENERIC_ERROR;
+			}
+#endif
+		} else if (!strcmp(opt, "queue=bio")) {
+			rdsk->queue_mode = RDSK_QUEUE_BIO;
+		} else if (!strcmp(opt, "queue=mq")) {
+#ifdef RDSK_BLK_MQ
+			rdsk->queue_mode = RDSK_QUEUE_MQ;
 #else
-static inline int bdev_openers(struct block_device *bdev)
-{
-	return bdev->bd_openers;
-}
+			pr_err("%s: blk-mq mode is not supported on this kernel.\n", PREFIX);
+			return GENERIC_ERROR;
 #endif
+		} else if (!strncmp(opt, "poll_queues=", 12)) {
+#ifdef RDSK_BLK_MQ
+			if (kstrtouint(opt + 12, 0, &rdsk->nr_poll_queues) ||
+			    rdsk->nr_poll_queues > nr_cpu_ids) {
+				pr_err("%s: Invalid number of poll queues: %s\n", PREFIX, opt + 12);
+				return GENERIC_ERROR;
+			}
+			poll_queues = true;
+#else
+			pr_err("%s: blk-mq mode is not supported on this kernel.\n", PREFIX);
+			return GENERIC_ERROR;
+#endif
+		} else {
+			pr_err("%s: Unsupported attach option: %s\n", PREFIX, opt);
+			return GENERIC_ERROR;
+		}
+	}
 
-static int rdsk_ioctl(struct block_device *bdev, fmode_t mode,
-		      unsigned int cmd, unsigned long arg)
-{
-	int error = 0;
-	struct rdsk_device *rdsk = bdev->bd_disk->private_data;
+#ifdef RDSK_BLK_MQ
+	if (rdsk->queue_mode != RDSK_QUEUE_MQ && poll_queues) {
+		pr_err("%s: poll_queues requires queue=mq.\n", PREFIX);
+		return GENERIC_ERROR;
+	}
+	/* Like null_blk, a single polled queue unless told otherwise. */
+	if (rdsk->queue_mode == RDSK_QUEUE_MQ && !poll_queues)
+		rdsk->nr_poll_queues = 1;
+#endif
 
-	switch (cmd) {
-	case IOCTL_RD_BLKFLSBUF:
-		/* We are killing the RAM disk data. */
-		mutex_lock(&ioctl_mutex);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,14,0)
-		mutex_lock(&bdev->bd_disk->open_mutex);
-#else
-		mutex_lock(&bdev->bd_mutex);
+	/* Compressed pages live in zsmalloc, outside of the page index. */
+	if (rdsk->comp_algo != RDSK_COMP_NONE &&
+	    (rdsk->page_order || rdsk->prealloc || rdsk->numa_policy != RDSK_NUMA_LOCAL ||
+	     rdsk->queue_mode != RDSK_QUEUE_BIO)) {
+		pr_err("%s: Compression cannot be combined with folio, prealloc, numa or queue=mq.\n",
+		       PREFIX);
+		return GENERIC_ERROR;
+	}
+
+	/* Only the windowed bio path knows the size of the whole transfer. */
+	if (rdsk->nt_threshold && (rdsk->page_order || rdsk->comp_algo != RDSK_COMP_NONE ||
+				   rdsk->queue_mode != RDSK_QUEUE_BIO)) {
+		pr_err("%s: nt_threshold cannot be combined with folio, compress or queue=mq.\n", PREFIX);
+		return GENERIC_ERROR;
+	}
+
+#ifdef RDSK_RESERVE
+	/* The pool holds single pages, and prealloc already owns every page it needs. */
+	if (rdsk->reserve && (rdsk->page_order || rdsk->prealloc ||
+			      rdsk->comp_algo != RDSK_COMP_NONE)) {
+		pr_err("%s: A reservation cannot be combined with folio, prealloc or compress.\n",
+		       PREFIX);
+		return GENERIC_ERROR;
+	}
 #endif
-		error = -EBUSY;
-		if (bdev_openers(bdev) <= 1) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0) || (defined(RHEL_MAJOR) && RHEL_MAJOR == 8 && RHEL_MINOR >= 4)
-			invalidate_bdev(bdev);
-#else
-			kill_bdev(bdev);
+
+#ifdef RDSK_MOVABLE
+	/* Pages may only move under the windowed bio path, and never while mapped elsewhere. */
+	if (rdsk->movable && (rdsk->page_order || rdsk->comp_algo != RDSK_COMP_NONE ||
+			      rdsk->reserve || rdsk->queue_mode != RDSK_QUEUE_BIO
+#ifdef RDSK_MIRROR
+			      || rdsk->mirror
 #endif
-#else
-			invalidate_bh_lrus();
-			truncate_inode_pages(bdev->bd_inode->i_mapping, 0);
+			      )) {
+		pr_err("%s: Movable pages cannot be combined with folio, compress, reserve, mirror or queue=mq.\n",
+		       PREFIX);
+		return GENERIC_ERROR;
+	}
 #endif
-			rdsk_free_pages(rdsk);
-			error = 0;
+
+#ifdef RDSK_ZONED
+	if (zoned) {
+		/* Zone resets free pages, and writes must go through the bio path. */
+		if (rdsk->page_order || rdsk->prealloc || rdsk->comp_algo != RDSK_COMP_NONE ||
+		    rdsk->queue_mode != RDSK_QUEUE_BIO
+#ifdef RDSK_MIRROR
+		    || rdsk->mirror
+#endif
+		    ) {
+			pr_err("%s: Zoned mode cannot be combined with folio, prealloc, compress, mirror or queue=mq.\n",
+			       PREFIX);
+			return GENERIC_ERROR;
 		}
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,14,0)
-		mutex_unlock(&bdev->bd_disk->open_mutex);
-#else
-		mutex_unlock(&bdev->bd_mutex);
+		if (rdsk_zoned_init(rdsk, zone_size, zone_nr_conv, zone_max_open,
+				    zone_max_active) != SUCCESS)
+			return GENERIC_ERROR;
+	}
 #endif
-		rdsk->max_blk_alloc = 0;
-		rdsk->max_page_cnt = 0;
-		mutex_unlock(&ioctl_mutex);
-		return error;
-	case IOCTL_INVALID_CDQUERY:
-	case IOCTL_INVALID_CDQUERY2:
-	case IOCTL_INVALID_TTY:
-	case IOCTL_INVALID_SG_IO:
-		return -EINVAL;
-	case IOCTL_RD_GET_STATS:
-		return copy_to_user((void __user *)arg,
-			&rdsk->max_blk_alloc,
-			sizeof(rdsk->max_blk_alloc)) ? -EFAULT : 0;
-	case IOCTL_RD_GET_USAGE:
-		return copy_to_user((void __user *)arg,
-			&rdsk->max_page_cnt,
-			sizeof(rdsk->max_page_cnt)) ? -EFAULT : 0;
+
+#ifdef RDSK_MIRROR
+	if (rdsk->mirror) {
+		/* Compressed pages are not in the page index the mirror thread copies from. */
+		if (rdsk->comp_algo != RDSK_COMP_NONE) {
+			pr_err("%s: A mirror file cannot be combined with compress.\n", PREFIX);
+			return GENERIC_ERROR;
+		}
+		rdsk->mirror->rate = mirror_rate;
+	} else if (mirror_rate) {
+		pr_err("%s: mirror_rate requires a mirror file.\n", PREFIX);
+		return GENERIC_ERROR;
 	}
+#endif
 
-	pr_warn("%s: 0x%x invalid ioctl.\n", PREFIX, cmd);
-	return -ENOTTY;		/* unknown command */
+	return SUCCESS;
 }
 
-static const struct block_device_operations rdsk_fops = {
-	.owner = THIS_MODULE,
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
-	.submit_bio = rdsk_submit_bio,
+#ifdef RDSK_NOWAIT
+/*
+ * Whether rdsk_submit_bio() can serve REQ_NOWAIT bios: it then allocates
+ * with GFP_NOWAIT and fails the bio with BLK_STS_AGAIN instead of sleeping.
+ * Compressed pages are stored under a mutex, and a zoned write advances the
+ * write pointer before its data is copied, so it could not be retried.
+ */
+static inline bool rdsk_nowait(struct rdsk_device *rdsk)
+{
+	if (rdsk->comp_algo != RDSK_COMP_NONE)
+		return false;
+#ifdef RDSK_ZONED
+	if (rdsk->zoned)
+		return false;
+#endif
+	return true;
+}
 #endif
-	.ioctl = rdsk_ioctl,
-};
 
-static int attach_device(unsigned long num, unsigned long long size)
+static int attach_device(unsigned long num, unsigned long long size, char *opts,
+			 struct rdsk_device *src)
 {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0) || (defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
 	int err = GENERIC_ERROR;
 #endif
-	struct rdsk_device *rdsk, *tmp;
+	struct rdsk_device *rdsk;
 	struct gendisk *disk;
 	sector_t sectors = 0;
 
@@ -792,21 +5081,53 @@ static int attach_device(unsigned long num, unsigned long long size)
 	}
 	sectors = (size / BYTES_PER_SECTOR);
 
-
-	list_for_each_entry(tmp, &rdsk_devices, rdsk_list) {
-		if (tmp->num == num) goto out;
-	}
+	if (rdsk_find_device(num))
+		goto out;
 
 	rdsk = kzalloc(sizeof(*rdsk), GFP_KERNEL);
 	if (!rdsk)
 		goto out;
+	kobject_init(&rdsk->kobj, &rdsk_ktype);
+	rdsk->stats = alloc_percpu(struct rdsk_stats);
+	if (!rdsk->stats)
+		goto out_free_dev;
+	rdsk->node_pages = __alloc_percpu(sizeof(long) * nr_node_ids, __alignof__(long));
+	if (!rdsk->node_pages)
+		goto out_free_dev;
 	rdsk->num = num;
-	rdsk->error_cnt = 0;
-	rdsk->max_blk_alloc = 0;
-	rdsk->max_page_cnt = 0;
+	atomic64_set(&rdsk->max_blk_alloc, 0);
+#ifdef RDSK_MEMDEV
+	mutex_init(&rdsk->mem_lock);
+#endif
+	mutex_init(&rdsk->wm_lock);
+	INIT_DELAYED_WORK(&rdsk->wm_work, rdsk_wm_fn);
 	rdsk->size = size;
-	spin_lock_init(&rdsk->rdsk_lock);
-	INIT_RADIX_TREE(&rdsk->rdsk_pages, GFP_ATOMIC);
+	rdsk->rdsk_shards = rdsk_alloc_shards();
+	if (!rdsk->rdsk_shards)
+		goto out_free_dev;
+	if (opts && rdsk_parse_options(rdsk, opts) != SUCCESS)
+		goto out_free_dev;
+#ifdef RDSK_COMPRESS
+	if (rdsk->comp_algo != RDSK_COMP_NONE && rdsk_comp_init(rdsk) != SUCCESS)
+		goto out_free_dev;
+#endif
+	/* Fail the attach before the disk goes live if memory is short. */
+	if (rdsk->prealloc &&
+	    rdsk_populate(rdsk, 0, DIV_ROUND_UP(size, PAGE_SIZE),
+			  GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN) != SUCCESS)
+		goto out_free_dev;
+#ifdef RDSK_RESERVE
+	if (rdsk->reserve && rdsk_pool_init(rdsk) != SUCCESS)
+		goto out_free_dev;
+#endif
+#ifdef RDSK_MIRROR
+	if (rdsk->mirror && rdsk_mirror_init(rdsk) != SUCCESS)
+		goto out_free_dev;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	if (src && rdsk_clone_pages(rdsk, src) != SUCCESS)
+		goto out_free_dev;
+#endif
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,14,0)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,7,0)
@@ -824,6 +5145,13 @@ static int attach_device(unsigned long num, unsigned long long size)
 	blk_queue_make_request(rdsk->rdsk_queue, rdsk_make_request);
 #endif
 #endif
+#ifdef RDSK_BLK_MQ
+	if (rdsk->queue_mode == RDSK_QUEUE_MQ) {
+		disk = rdsk->rdsk_disk = rdsk_mq_alloc_disk(rdsk);
+		if (!disk)
+			goto out_free_dev;
+	} else {
+#endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6,9,0)
 	disk = rdsk->rdsk_disk = blk_alloc_disk(NULL, NUMA_NO_NODE);
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,14,0)
@@ -837,12 +5165,39 @@ static int attach_device(unsigned long num, unsigned long long size)
 	if (!disk)
 #endif
 		goto out_free_queue;
+#ifdef RDSK_BLK_MQ
+	}
+#endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6,11,0)
 	struct request_queue *q = disk->queue;
 	struct queue_limits lim;
 	lim = queue_limits_start_update(q);
 	lim.logical_block_size = BYTES_PER_SECTOR;
 	lim.physical_block_size = PAGE_SIZE;
+	lim.discard_granularity = PAGE_SIZE;
+	lim.max_hw_discard_sectors = UINT_MAX;
+	lim.max_write_zeroes_sectors = UINT_MAX;
+#ifdef RDSK_NOWAIT
+	if (rdsk_nowait(rdsk))
+		lim.features |= BLK_FEAT_NOWAIT;
+#endif
+	lim.features |= BLK_FEAT_IO_STAT;
+#ifdef RDSK_ZONED
+	if (rdsk->zoned) {
+		/* Sequential zones cannot be discarded; reset them instead. */
+		lim.features |= BLK_FEAT_ZONED;
+		lim.chunk_sectors = 1U << rdsk->zoned->zone_shift;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+		lim.max_hw_zone_append_sectors = min(lim.chunk_sectors, lim.max_hw_sectors);
+#else
+		lim.max_zone_append_sectors = min(lim.chunk_sectors, lim.max_hw_sectors);
+#endif
+		lim.max_open_zones = rdsk->zoned->max_open;
+		lim.max_active_zones = rdsk->zoned->max_active;
+		lim.max_hw_discard_sectors = 0;
+		lim.max_write_zeroes_sectors = 0;
+	}
+#endif
 	queue_limits_commit_update(q, &lim);
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,14,0)
 	blk_queue_logical_block_size(disk->queue, BYTES_PER_SECTOR);
@@ -869,16 +5224,26 @@ static int attach_device(unsigned long num, unsigned long long size)
 	disk->queue->limits.max_sectors = (max_sectors * 2);
 	disk->queue->nr_requests = nr_requests;
 	disk->queue->limits.discard_granularity = PAGE_SIZE;
+#ifdef RDSK_ZONED
+	if (!rdsk->zoned)
+#endif
 	disk->queue->limits.max_discard_sectors = UINT_MAX;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6,11,0)
-	blk_queue_disable_discard(disk->queue);
+	/* Discard and write zeroes limits are set through queue_limits above. */
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0) || (defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
-	blk_queue_max_discard_sectors(disk->queue, 0);
+	blk_queue_max_discard_sectors(disk->queue, UINT_MAX);
+	blk_queue_max_write_zeroes_sectors(disk->queue, UINT_MAX);
 #else
 	blk_queue_flag_set(QUEUE_FLAG_DISCARD, disk->queue);
+	blk_queue_max_write_zeroes_sectors(disk->queue, UINT_MAX);
 #endif
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6,11,0)
 	blk_queue_flag_set(QUEUE_FLAG_NONROT, disk->queue);
+#ifdef RDSK_NOWAIT
+	if (rdsk_nowait(rdsk))
+		blk_queue_flag_set(QUEUE_FLAG_NOWAIT, disk->queue);
+#endif
+	blk_queue_flag_set(QUEUE_FLAG_IO_STAT, disk->queue);
 #endif
 #else
 	rdsk->rdsk_queue->limits.max_sectors = (max_sectors * 2);
@@ -895,11 +5260,21 @@ static int attach_device(unsigned long num, unsigned long long size)
 	blk_queue_flag_set(QUEUE_FLAG_DISCARD, rdsk->rdsk_queue);
 #endif
 #endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	blk_queue_max_write_zeroes_sectors(rdsk->rdsk_queue, UINT_MAX);
+#endif
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, rdsk->rdsk_queue);
 #else
 	blk_queue_flag_set(QUEUE_FLAG_NONROT, rdsk->rdsk_queue);
 #endif
+#ifdef RDSK_NOWAIT
+	if (rdsk_nowait(rdsk))
+		blk_queue_flag_set(QUEUE_FLAG_NOWAIT, rdsk->rdsk_queue);
+#endif
+#ifdef RDSK_IO_ACCT
+	blk_queue_flag_set(QUEUE_FLAG_IO_STAT, rdsk->rdsk_queue);
+#endif
 #endif
 
 	disk->major = rd_ma_no;
@@ -908,6 +5283,10 @@ static int attach_device(unsigned long num, unsigned long long size)
 	disk->minors = 1;
 #endif
 	disk->fops = &rdsk_fops;
+#ifdef RDSK_BLK_MQ
+	if (rdsk->queue_mode == RDSK_QUEUE_MQ)
+		disk->fops = &rdsk_mq_fops;
+#endif
 	disk->private_data = rdsk;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,14,0)
 	disk->queue = rdsk->rdsk_queue;
@@ -920,24 +5299,90 @@ static int attach_device(unsigned long num, unsigned long long size)
 	sprintf(disk->disk_name, "rd%lu", num);
 	set_capacity(disk, sectors);
 
+#ifdef RDSK_ZONED
+	if (rdsk->zoned && blk_revalidate_disk_zones(disk)) {
+		pr_err("%s: Unable to set up the zones of rd%lu.\n", PREFIX, num);
+		goto out_put_disk;
+	}
+#endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0) || (defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
 	err = add_disk(disk);
 	if (err)
-		goto out_free_queue;
+		goto out_put_disk;
 #else
 	add_disk(disk);
 #endif
-	list_add_tail(&rdsk->rdsk_list, &rdsk_devices);
+	if (kobject_add(&rdsk->kobj, rdsk_kobj, "rd%lu", num) ||
+	    sysfs_create_group(&rdsk->kobj, &rdsk_attr_group) || rdsk_add_device(rdsk))
+		goto out_del_disk;
+#ifdef RDSK_MEMDEV
+	rdsk_mem_register(rdsk);
+#endif
 	rd_total++;
 	pr_info("%s: Attached rd%lu of %llu bytes in size.\n", PREFIX, num, rdsk->size);
+	if (rdsk->page_order)
+		pr_info("%s: rd%lu is backed by %lu byte folios.\n", PREFIX, num,
+			PAGE_SIZE << rdsk->page_order);
+	if (rdsk->prealloc)
+		pr_info("%s: rd%lu is fully preallocated.\n", PREFIX, num);
+#ifdef RDSK_RESERVE
+	if (rdsk->pool)
+		pr_info("%s: rd%lu has %lu pages reserved.\n", PREFIX, num, rdsk->reserve);
+#endif
+	if (rdsk->movable)
+		pr_info("%s: rd%lu pages are movable.\n", PREFIX, num);
+#ifdef RDSK_ZONED
+	if (rdsk->zoned)
+		pr_info("%s: rd%lu is zoned with %u zones of %llu bytes, %u of them conventional.\n",
+			PREFIX, num, rdsk->zoned->nr_zones,
+			(1ULL << rdsk->zoned->zone_shift) << SECTOR_SHIFT, rdsk->zoned->nr_conv);
+#endif
+	if (rdsk->nt_threshold)
+		pr_info("%s: rd%lu bypasses the CPU caches for writes of %u bytes or more.\n", PREFIX,
+			num, rdsk->nt_threshold);
+	if (src)
+		pr_info("%s: rd%lu shares its pages with rd%d.\n", PREFIX, num, src->num);
+#ifdef RDSK_MIRROR
+	if (rdsk->mirror)
+		pr_info("%s: rd%lu is mirrored to %s.\n", PREFIX, num, rdsk->mirror->path);
+#endif
+	if (rdsk->comp_algo != RDSK_COMP_NONE)
+		pr_info("%s: rd%lu stores pages %s compressed.\n", PREFIX, num,
+			rdsk->comp_algo == RDSK_COMP_ZSTD ? "zstd" : "lz4");
+	if (rdsk->numa_policy == RDSK_NUMA_BIND)
+		pr_info("%s: rd%lu is bound to NUMA node %d.\n", PREFIX, num, rdsk->numa_node);
+	else if (rdsk->numa_policy == RDSK_NUMA_INTERLEAVE)
+		pr_info("%s: rd%lu is interleaved across %d NUMA nodes.\n", PREFIX, num,
+			num_node_state(N_MEMORY));
+#ifdef RDSK_BLK_MQ
+	if (rdsk->queue_mode == RDSK_QUEUE_MQ)
+		pr_info("%s: rd%lu uses blk-mq with %u submit and %u poll queues.\n", PREFIX,
+			num, nr_cpu_ids, rdsk->nr_poll_queues);
+#endif
 	return SUCCESS;
 
+out_del_disk:
+	kobject_del(&rdsk->kobj);
+	del_gendisk(disk);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0) || (defined(RHEL_MAJOR) && RHEL_MAJOR >= 9 && RHEL_MINOR >= 0)
+out_put_disk:
+#endif
+	put_disk(disk);
+#ifdef RDSK_BLK_MQ
+	rdsk_mq_free(rdsk);
+#endif
 out_free_queue:
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,14,0)
 	blk_cleanup_queue(rdsk->rdsk_queue);
+#endif
 out_free_dev:
+#ifdef RDSK_MIRROR
+	rdsk_mirror_stop(rdsk);
 #endif
-	kfree(rdsk);
+	WRITE_ONCE(rdsk->mig_gone, true);
+	if (rdsk->stats && rdsk->node_pages)
+		rdsk_free_pages(rdsk);
+	kobject_put(&rdsk->kobj);
 out:
 	return GENERIC_ERROR;
 }
@@ -945,35 +5390,158 @@ out:
 static int detach_device(unsigned long num)
 {
 	struct rdsk_device *rdsk;
-	bool found = false;
-
-	list_for_each_entry(rdsk, &rdsk_devices, rdsk_list)
-		if (rdsk->num == num) {
-			found = true;
-			break;
-		}
+#ifdef RDSK_ASYNC_TEARDOWN
+	struct rdsk_reap *reap = NULL;
+#endif
 
-	if (!found)
+	rdsk = rdsk_find_device(num);
+	if (!rdsk)
 		return GENERIC_ERROR;
 
-	list_del(&rdsk->rdsk_list);
+#ifdef RDSK_MEMDEV
+	if (rdsk_mem_unregister(rdsk) != SUCCESS) {
+		pr_warn("%s: /dev/%s is still in use.\n", PREFIX, rdsk->mem_name);
+		return GENERIC_ERROR;
+	}
+#endif
+	/* Watermark checks must not touch the sysfs files and the disk once they are gone. */
+	mutex_lock(&rdsk->wm_lock);
+	rdsk->wm_gone = true;
+	WRITE_ONCE(rdsk->wm_nr, 0);
+	WRITE_ONCE(rdsk->wm_level, 0);
+	mutex_unlock(&rdsk->wm_lock);
+	rdsk_del_device(rdsk);
+	kobject_del(&rdsk->kobj);
 	del_gendisk(rdsk->rdsk_disk);
+	cancel_delayed_work_sync(&rdsk->wm_work);
 	put_disk(rdsk->rdsk_disk);
+#ifdef RDSK_BLK_MQ
+	rdsk_mq_free(rdsk);
+#endif
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,14,0)
 	blk_cleanup_queue(rdsk->rdsk_queue);
+#endif
+#ifdef RDSK_MIRROR
+	/* No more I/O can arrive; write out what is left before the pages go. */
+	rdsk_mirror_stop(rdsk);
+#endif
+	WRITE_ONCE(rdsk->mig_gone, true);
+#ifdef RDSK_ASYNC_TEARDOWN
+	if (rdsk->comp_algo == RDSK_COMP_NONE && !rdsk->movable)
+		reap = kzalloc(sizeof(*reap), GFP_KERNEL);
+	if (reap)
+		rdsk_reap_index(rdsk, reap, NULL);
+	else
 #endif
 	rdsk_free_pages(rdsk);
-	kfree(rdsk);
+	kobject_put(&rdsk->kobj);
 	rd_total--;
 	pr_info("%s: Detached rd%lu.\n", PREFIX, num);
 
 	return SUCCESS;
 }
 
+static void rdsk_set_capacity(struct rdsk_device *rdsk, sector_t sectors)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,11,0)
+	/* Also updates the block device size and sends a uevent. */
+	set_capacity_and_notify(rdsk->rdsk_disk, sectors);
+#else
+	set_capacity(rdsk->rdsk_disk, sectors);
+#endif
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+/* Wait for all I/O in flight and hold off new I/O until rdsk_unfreeze(). */
+static unsigned int rdsk_freeze(struct rdsk_device *rdsk)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,14,0)
+	return blk_mq_freeze_queue(rdsk->rdsk_disk->queue);
+#else
+	blk_mq_freeze_queue(rdsk->rdsk_disk->queue);
+	return 0;
+#endif
+}
+
+static void rdsk_unfreeze(struct rdsk_device *rdsk, unsigned int memflags)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,14,0)
+	blk_mq_unfreeze_queue(rdsk->rdsk_disk->queue, memflags);
+#else
+	blk_mq_unfreeze_queue(rdsk->rdsk_disk->queue);
+#endif
+}
+
+/*
+ * Shrink a live device. The queue is frozen so that no I/O is in flight
+ * while the capacity drops, after which bios past the new end fail in the
+ * block layer. Every page past the end is then unlinked a shard stripe at
+ * a time, rescheduling in between, and freed through RCU.
+ */
+static void rdsk_shrink(struct rdsk_device *rdsk, unsigned long long size)
+{
+	sector_t sectors = size >> SECTOR_SHIFT;
+	pgoff_t first = DIV_ROUND_UP(size, PAGE_SIZE);
+	pgoff_t last = DIV_ROUND_UP(rdsk->size, PAGE_SIZE) - 1;
+	unsigned int memflags;
+
+	memflags = rdsk_freeze(rdsk);
+	rdsk_set_capacity(rdsk, sectors);
+	rdsk->size = size;
+	if (atomic64_read(&rdsk->max_blk_alloc) > sectors)
+		atomic64_set(&rdsk->max_blk_alloc, sectors);
+
+	/* The tail of a page straddling the new end must read zero if it grows back. */
+	if (size & ~PAGE_MASK)
+		rdsk_zero_range(rdsk, sectors, PAGE_SIZE - (size & ~PAGE_MASK));
+	if (first <= last)
+		rdsk_discard_pages(rdsk, first, last);
+	rdsk_unfreeze(rdsk, memflags);
+}
+
+/*
+ * Populate a new device with the pages of src, taking a reference on each.
+ * src is frozen for the walk, so that no write can change a page between it
+ * being shared and both devices being flagged for copy on write.
+ */
+static int rdsk_clone_pages(struct rdsk_device *rdsk, struct rdsk_device *src)
+{
+	unsigned long idx, shared = 0;
+	unsigned int memflags;
+	struct page *page;
+	int i, err = SUCCESS;
+
+	mutex_lock(&ioctl_mutex);
+	memflags = rdsk_freeze(src);
+	src->cow = true;
+	for (i = 0; i < RDSK_SHARDS && err == SUCCESS; i++) {
+		xa_for_each(&src->rdsk_shards[i].pages, idx, page) {
+			get_page(page);
+			/* No reclaim into the frozen source. */
+			if (xa_err(xa_store(&rdsk->rdsk_shards[i].pages, idx, page, GFP_NOIO))) {
+				put_page(page);
+				err = GENERIC_ERROR;
+				break;
+			}
+			rdsk_count_node(rdsk, page, 1);
+			shared++;
+			cond_resched();
+		}
+	}
+	rdsk->cow = true;
+	atomic64_set(&rdsk->max_blk_alloc, atomic64_read(&src->max_blk_alloc));
+	rdsk_unfreeze(src, memflags);
+	mutex_unlock(&ioctl_mutex);
+
+	/* Shared pages are not new allocations; only count them as used. */
+	this_cpu_add(rdsk->stats->pages, shared);
+	return err;
+}
+#endif
+
 static int resize_device(unsigned long num, unsigned long long size)
 {
 	struct rdsk_device *rdsk;
-	bool found = false;
 	sector_t sectors = 0;
 
 	if (size % BYTES_PER_SECTOR != 0) {
@@ -983,30 +5551,145 @@ static int resize_device(unsigned long num, unsigned long long size)
 	}
 	sectors = (size / BYTES_PER_SECTOR);
 
-	list_for_each_entry(rdsk, &rdsk_devices, rdsk_list)
-		if (rdsk->num == num) {
-			found = true;
-			break;
-		}
+	rdsk = rdsk_find_device(num);
+	if (!rdsk)
+		return GENERIC_ERROR;
+
+#ifdef RDSK_COMPRESS
+	if (rdsk->comp) {
+		pr_warn("%s: Compressed devices cannot be resized.\n", PREFIX);
+		return GENERIC_ERROR;
+	}
+#endif
+#ifdef RDSK_MIRROR
+	if (rdsk->mirror) {
+		pr_warn("%s: Mirrored devices cannot be resized.\n", PREFIX);
+		return GENERIC_ERROR;
+	}
+#endif
+#ifdef RDSK_ZONED
+	if (rdsk->zoned) {
+		pr_warn("%s: Zoned devices cannot be resized.\n", PREFIX);
+		return GENERIC_ERROR;
+	}
+#endif
 
-	if (!found)
+	if (!sectors || size == rdsk->size) {
+		pr_warn("%s: Please specify a different size for resizing.\n",
+			PREFIX);
 		return GENERIC_ERROR;
+	}
 
-	/* WARNING - I am unable to rely on mutexes here due to its impact on performance.
-	 *   As a result, if reducing to a smaller size, there is a risk of a memory leak.
-	 *   If a resize is done, it should be done while no I/O is running to the device.
-	 */
-	if (size <= (rdsk->max_blk_alloc * BYTES_PER_SECTOR)) {
+	if (size < rdsk->size) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+#ifdef RDSK_RESERVE
+		if (size < (unsigned long long)rdsk->reserve << PAGE_SHIFT) {
+			pr_warn("%s: rd%lu cannot be shrunk below its reservation.\n", PREFIX, num);
+			return GENERIC_ERROR;
+		}
+#endif
+#ifdef RDSK_MEMDEV
+		mutex_lock(&rdsk->mem_lock);
+		if (rdsk_mem_mapped(rdsk)) {
+			mutex_unlock(&rdsk->mem_lock);
+			pr_warn("%s: rd%lu cannot be shrunk while it is mapped.\n", PREFIX, num);
+			return GENERIC_ERROR;
+		}
+#endif
+		mutex_lock(&ioctl_mutex);
+		rdsk_shrink(rdsk, size);
+		mutex_unlock(&ioctl_mutex);
+#ifdef RDSK_MEMDEV
+		mutex_unlock(&rdsk->mem_lock);
+#endif
+		pr_info("%s: Shrunk rd%lu to %llu bytes in size.\n", PREFIX, num, size);
+		return SUCCESS;
+#else
 		pr_warn("%s: Please specify a larger size for resizing.\n",
 			PREFIX);
 		return GENERIC_ERROR;
+#endif
 	}
-	set_capacity(rdsk->rdsk_disk, sectors);
+
+	mutex_lock(&ioctl_mutex);
+	/* Pages populated by a failed attempt are released at detach. */
+	if (rdsk->prealloc &&
+	    rdsk_populate(rdsk, DIV_ROUND_UP(rdsk->size, PAGE_SIZE), DIV_ROUND_UP(size, PAGE_SIZE),
+			  GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN) != SUCCESS) {
+		mutex_unlock(&ioctl_mutex);
+		return GENERIC_ERROR;
+	}
+	rdsk_set_capacity(rdsk, sectors);
 	rdsk->size = size;
+	mutex_unlock(&ioctl_mutex);
 	pr_info("%s: Resized rd%lu of %llu bytes in size.\n", PREFIX, num, size);
 	return SUCCESS;
 }
 
+/*
+ * Attach a new device that starts out with the contents of src. Both share
+ * every page until either side writes to it, so cloning costs an index
+ * entry per page rather than a copy.
+ */
+static int clone_device(unsigned long src_num, unsigned long num)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	struct rdsk_device *src;
+#ifdef RDSK_MEMDEV
+	int err;
+#endif
+
+	src = rdsk_find_device(src_num);
+	if (!src)
+		return GENERIC_ERROR;
+
+	/* These either promise never to allocate on write or do not index plain pages. */
+	if (src->prealloc || src->page_order || src->comp_algo != RDSK_COMP_NONE) {
+		pr_warn("%s: Preallocated, folio and compressed devices cannot be cloned.\n",
+			PREFIX);
+		return GENERIC_ERROR;
+	}
+#ifdef RDSK_RESERVE
+	/* Shared pages cannot be recycled, so the reservation could not be kept. */
+	if (src->pool) {
+		pr_warn("%s: Devices with a reservation cannot be cloned.\n", PREFIX);
+		return GENERIC_ERROR;
+	}
+#endif
+#ifdef RDSK_MOVABLE
+	/* A page cannot move while another device's index also points at it. */
+	if (src->movable) {
+		pr_warn("%s: Devices with movable pages cannot be cloned.\n", PREFIX);
+		return GENERIC_ERROR;
+	}
+#endif
+#ifdef RDSK_ZONED
+	/* The clone would not know where the write pointers are. */
+	if (src->zoned) {
+		pr_warn("%s: Zoned devices cannot be cloned.\n", PREFIX);
+		return GENERIC_ERROR;
+	}
+#endif
+#ifdef RDSK_MEMDEV
+	/* Mapped pages would be shared without copy on write protecting them. */
+	mutex_lock(&src->mem_lock);
+	if (rdsk_mem_mapped(src)) {
+		mutex_unlock(&src->mem_lock);
+		pr_warn("%s: rd%lu cannot be cloned while it is mapped.\n", PREFIX, src_num);
+		return GENERIC_ERROR;
+	}
+	err = attach_device(num, src->size, NULL, src);
+	mutex_unlock(&src->mem_lock);
+	return err;
+#else
+	return attach_device(num, src->size, NULL, src);
+#endif
+#else
+	pr_warn("%s: Cloning requires a 4.20 or later kernel.\n", PREFIX);
+	return GENERIC_ERROR;
+#endif
+}
+
 static int __init init_rd(void)
 {
 	int retval, i;
@@ -1019,15 +5702,19 @@ static int __init init_rd(void)
 		return rd_ma_no;
 	}
 
+	rdsk_wq = alloc_workqueue("rapiddisk", WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
+	if (!rdsk_wq)
+		goto init_failure;
+
 	rdsk_kobj = kobject_create_and_add("rapiddisk", kernel_kobj);
 	if (!rdsk_kobj)
-		goto init_failure;
+		goto init_failure3;
 	retval = sysfs_create_group(rdsk_kobj, &attr_group);
 	if (retval)
 		goto init_failure2;
 
 	for (i = 0; i < rd_nr; i++) {
-		retval = attach_device(i, rd_size * 2048);
+		retval = attach_device(i, rd_size * 2048, NULL, NULL);
 		if (retval) {
 			pr_err("%s: Failed to load RapidDisk volume rd%d.\n",
 			       PREFIX, i);
@@ -1038,6 +5725,8 @@ static int __init init_rd(void)
 
 init_failure2:
 	kobject_put(rdsk_kobj);
+init_failure3:
+	destroy_workqueue(rdsk_wq);
 init_failure:
 	unregister_blkdev(rd_ma_no, PREFIX);
 	return -ENOMEM;
@@ -1045,11 +5734,20 @@ init_failure:
 
 static void __exit exit_rd(void)
 {
-	struct rdsk_device *rdsk, *next;
+	struct rdsk_device *rdsk;
+	unsigned long num;
 
+	/*
+	 * An open /dev/rdN_mem holds a module reference, so no detach can
+	 * fail here. The module text goes away regardless of what is returned,
+	 * so a failure is only reported and the teardown carries on.
+	 */
+	rdsk_for_each_device(rdsk, num)
+		WARN_ON_ONCE(detach_device(num) != SUCCESS);
 	kobject_put(rdsk_kobj);
-	list_for_each_entry_safe(rdsk, next, &rdsk_devices, rdsk_list)
-		detach_device(rdsk->num);
+	destroy_workqueue(rdsk_wq);
+	/* Wait for pages freed by zero page elision. */
+	rcu_barrier();
 	unregister_blkdev(rd_ma_no, PREFIX);
 }
 
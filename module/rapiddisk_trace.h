@@ -0,0 +1,151 @@
+/*******************************************************************************
+ ** Copyright © 2011 - 2025 Petros Koutoupis
+ ** All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation; under version 2 of the License.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ** SPDX-License-Identifier: GPL-2.0-only
+ **
+ ** filename: rapiddisk_trace.h
+ ** description: Trace events of the RapidDisk RAM disk module, available
+ **	 under /sys/kernel/tracing/events/rapiddisk/.
+ **
+ ******************************************************************************/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rapiddisk
+
+#if !defined(_RAPIDDISK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RAPIDDISK_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define RDSK_TRACE_OP_LEN	16
+
+TRACE_EVENT(rapiddisk_submit,
+
+	TP_PROTO(int num, sector_t sector, unsigned int bytes, const char *op),
+
+	TP_ARGS(num, sector, bytes, op),
+
+	TP_STRUCT__entry(
+		__field(int, num)
+		__field(sector_t, sector)
+		__field(unsigned int, bytes)
+		__array(char, op, RDSK_TRACE_OP_LEN)
+	),
+
+	TP_fast_assign(
+		__entry->num = num;
+		__entry->sector = sector;
+		__entry->bytes = bytes;
+		strncpy(__entry->op, op, RDSK_TRACE_OP_LEN - 1);
+		__entry->op[RDSK_TRACE_OP_LEN - 1] = '\0';
+	),
+
+	TP_printk("rd%d %s sector=%llu bytes=%u", __entry->num, __entry->op,
+		  (unsigned long long)__entry->sector, __entry->bytes)
+);
+
+TRACE_EVENT(rapiddisk_complete,
+
+	TP_PROTO(int num, sector_t sector, unsigned int bytes, const char *op,
+		 int error, u64 latency_ns),
+
+	TP_ARGS(num, sector, bytes, op, error, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(int, num)
+		__field(sector_t, sector)
+		__field(unsigned int, bytes)
+		__array(char, op, RDSK_TRACE_OP_LEN)
+		__field(int, error)
+		__field(u64, latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->num = num;
+		__entry->sector = sector;
+		__entry->bytes = bytes;
+		strncpy(__entry->op, op, RDSK_TRACE_OP_LEN - 1);
+		__entry->op[RDSK_TRACE_OP_LEN - 1] = '\0';
+		__entry->error = error;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("rd%d %s sector=%llu bytes=%u error=%d latency_ns=%llu",
+		  __entry->num, __entry->op, (unsigned long long)__entry->sector,
+		  __entry->bytes, __entry->error,
+		  (unsigned long long)__entry->latency_ns)
+);
+
+DECLARE_EVENT_CLASS(rapiddisk_pages,
+
+	TP_PROTO(int num, unsigned long nr),
+
+	TP_ARGS(num, nr),
+
+	TP_STRUCT__entry(
+		__field(int, num)
+		__field(unsigned long, nr)
+	),
+
+	TP_fast_assign(
+		__entry->num = num;
+		__entry->nr = nr;
+	),
+
+	TP_printk("rd%d nr=%lu", __entry->num, __entry->nr)
+);
+
+DEFINE_EVENT(rapiddisk_pages, rapiddisk_page_alloc,
+
+	TP_PROTO(int num, unsigned long nr),
+
+	TP_ARGS(num, nr)
+);
+
+DEFINE_EVENT(rapiddisk_pages, rapiddisk_page_free,
+
+	TP_PROTO(int num, unsigned long nr),
+
+	TP_ARGS(num, nr)
+);
+
+TRACE_EVENT(rapiddisk_alloc_fail,
+
+	TP_PROTO(int num, pgoff_t idx),
+
+	TP_ARGS(num, idx),
+
+	TP_STRUCT__entry(
+		__field(int, num)
+		__field(pgoff_t, idx)
+	),
+
+	TP_fast_assign(
+		__entry->num = num;
+		__entry->idx = idx;
+	),
+
+	TP_printk("rd%d page=%lu", __entry->num, (unsigned long)__entry->idx)
+);
+
+#endif /* _RAPIDDISK_TRACE_H */
+
+/* The module is built out of tree, so look for this header next to rapiddisk.c. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rapiddisk_trace
+#include <trace/define_trace.h>
@@ -118,7 +118,7 @@ int trace_make_request_return(struct pt_regs *ctx)
 # Starting from Linux 5.9, make_request operations were replaced with submit_bio.
 # We are detecing proper functions to trace here.
 if BPF.get_kprobe_functions(b'rdsk_submit_bio'):
-    make_request_rn = 'rdsk_submit_bio'
+    make_request_fn = 'rdsk_submit_bio'
 else:
     make_request_fn = 'rdsk_make_request'
 
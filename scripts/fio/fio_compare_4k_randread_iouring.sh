@@ -0,0 +1,25 @@
+#!/bin/bash
+
+if [ ! "$BASH_VERSION" ] ; then
+        exec /bin/bash "$0" "$@"
+fi
+
+[ $# -ne "1" ] && echo "Error. Please input a RapidDisk device." && exit 1
+
+# Compare io_uring latency on a bio-based (queue=bio) and a blk-mq (queue=mq)
+# RapidDisk device. Polled completions (IORING_SETUP_IOPOLL) are only tested
+# when the device exposes poll queues. Run it once against each mode.
+#
+# Status: not yet measured. The bio versus blk-mq comparison has not been
+# taken on any host and is still outstanding.
+DEV=$(basename $1)
+
+fio --bs=4k --ioengine=io_uring --iodepth=1 --size=1g --direct=1 --runtime=30 --filename=$1 --rw=randread --name=fio-rapiddisk-iouring-irq --numjobs=1 --group_reporting
+
+if [ "$(cat /sys/block/${DEV}/queue/io_poll 2>/dev/null)" == "1" ]; then
+	fio --bs=4k --ioengine=io_uring --hipri=1 --fixedbufs=1 --registerfiles=1 --iodepth=1 --size=1g --direct=1 --runtime=30 --filename=$1 --rw=randread --name=fio-rapiddisk-iouring-poll --numjobs=1 --group_reporting
+else
+	echo "${DEV} has no poll queues (attach it with queue=mq to test IOPOLL)."
+fi
+
+exit $?
@@ -0,0 +1,26 @@
+#!/bin/bash
+
+if [ ! "$BASH_VERSION" ] ; then
+        exec /bin/bash "$0" "$@"
+fi
+
+[ $# -ne "1" ] && echo "Error. Please input a compressed RapidDisk device (attached with compress=lz4 or compress=zstd)." && exit 1
+
+# Fill the device with data of increasing compressibility and report the
+# write throughput, the read back throughput, the CPU time fio saw spent in
+# user and system context (the compression happens in the submitting task)
+# and the resulting compression ratio for each pass. Run it against a plain
+# device as well to get the CPU cost of compression. The device must be at
+# least 1 GB in size.
+#
+# Status: not yet measured. The compression ratio and CPU cost of lz4 and
+# zstd have not been taken on any host and are still outstanding.
+for pct in 0 25 50 75 90; do
+	rapiddisk -f $(basename $1) >/dev/null 2>&1
+	echo "buffer_compress_percentage=${pct}"
+	fio --bs=4k --ioengine=libaio --iodepth=32 --size=1g --direct=1 --filename=$1 --rw=write --name=fio-rapiddisk-compress-write-test --numjobs=1 --buffer_compress_percentage=${pct} --buffer_compress_chunk=4k --refill_buffers | grep -E "IOPS|cpu"
+	fio --bs=4k --ioengine=libaio --iodepth=32 --size=1g --direct=1 --filename=$1 --rw=randread --name=fio-rapiddisk-compress-read-test --numjobs=8 --group_reporting | grep -E "IOPS|cpu"
+	cat /sys/kernel/rapiddisk/$(basename $1)/compression
+done
+
+exit $?
@@ -0,0 +1,26 @@
+#!/bin/bash
+
+if [ ! "$BASH_VERSION" ] ; then
+        exec /bin/bash "$0" "$@"
+fi
+
+[ $# -ne "1" ] && echo "Error. Please input a RapidDisk device." && exit 1
+
+# Measure the cost of /proc/diskstats accounting: run the same small block
+# job with queue/iostats turned off and on, and compare the IOPS and the
+# latency percentiles of the two passes. The original setting is restored
+# afterwards.
+#
+# Status: not yet measured. The accounting overhead has not been taken on
+# any host and is still outstanding.
+DEV=$(basename $1)
+ORIG=$(cat /sys/block/${DEV}/queue/iostats)
+
+for stat in 0 1; do
+	echo ${stat} > /sys/block/${DEV}/queue/iostats
+	echo "iostats=${stat}"
+	fio --bs=4k --ioengine=io_uring --iodepth=32 --size=1g --direct=1 --runtime=30 --time_based --filename=$1 --rw=randread --name=fio-rapiddisk-iostats-test --numjobs=4 --group_reporting | grep -E "IOPS|clat percentiles|99.00th|cpu"
+done
+echo ${ORIG} > /sys/block/${DEV}/queue/iostats
+
+exit $?
@@ -0,0 +1,32 @@
+#!/bin/bash
+
+if [ ! "$BASH_VERSION" ] ; then
+        exec /bin/bash "$0" "$@"
+fi
+
+[ $# -ne "2" ] && echo "Error. Please input a RapidDisk device attached without and one attached with nt_threshold (i.e. nt_threshold=256K)." && exit 1
+
+# Stream 1 MB writes to each device while a cache-sensitive neighbor keeps
+# randomly reading a working set that fits in the last level cache. Report
+# the write bandwidth of the device and the read rate of the neighbor; the
+# neighbor should lose less with the non-temporal device. The difference in
+# write bandwidth and CPU time between the two devices is the overhead of the
+# non-temporal copy. Both devices must be at least 1 GB in size.
+#
+# Status: not yet measured. The effect on the neighbor and the overhead of
+# the non-temporal copy have not been taken on any host and are still
+# outstanding.
+WSET=${WSET:-8m}
+NEIGHBOR=$(mktemp -p /dev/shm rapiddisk-nt.XXXXXX)
+trap "rm -f ${NEIGHBOR}" EXIT
+
+echo "neighbor alone"
+fio --bs=64 --ioengine=mmap --size=${WSET} --runtime=30 --time_based --filename=${NEIGHBOR} --rw=randread --name=fio-rapiddisk-nt-neighbor | grep -E "IOPS"
+
+for dev in $1 $2; do
+	echo "$(basename ${dev}): $(grep nt_threshold /sys/kernel/rapiddisk/$(basename ${dev})/stats || echo nt_threshold 0)"
+	fio --bs=1m --ioengine=libaio --iodepth=4 --size=1g --direct=1 --runtime=30 --time_based --filename=${dev} --rw=write --name=fio-rapiddisk-nt-write \
+	    --name=fio-rapiddisk-nt-neighbor --bs=64 --ioengine=mmap --size=${WSET} --direct=0 --iodepth=1 --filename=${NEIGHBOR} --rw=randread | grep -E "IOPS|BW=|cpu"
+done
+
+exit $?
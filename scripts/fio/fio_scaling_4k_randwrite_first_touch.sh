@@ -0,0 +1,25 @@
+#!/bin/bash
+
+if [ ! "$BASH_VERSION" ] ; then
+        exec /bin/bash "$0" "$@"
+fi
+
+[ $# -ne "1" ] && echo "Error. Please input a RapidDisk device." && exit 1
+
+# Measure first-touch (page allocating) 4K random write throughput as the
+# number of submitting jobs grows. The device is flushed before every run
+# so that each pass has to populate the page index from scratch. Every job
+# writes its own 1 GB region, so the device must be at least 64 GB in size.
+# The sharded page index is only worth it where the IOPS keep climbing with
+# numjobs; run the sweep against the module from before the change too and
+# compare.
+#
+# Status: not yet measured. The before and after numbers for the sharded
+# index have not been taken on any host and are still outstanding.
+for jobs in 1 2 4 8 16 32 64; do
+	rapiddisk -f $(basename $1) >/dev/null 2>&1
+	echo "numjobs=${jobs}"
+	fio --bs=4k --ioengine=libaio --iodepth=32 --size=1g --direct=1 --filename=$1 --rw=randwrite --name=fio-rapiddisk-first-touch-test --numjobs=${jobs} --offset_increment=1g --group_reporting | grep -E "IOPS|lat \(usec\): min"
+done
+
+exit $?
@@ -30,6 +30,8 @@ SPDX-License-Identifier: GPL-2.0-or-later
 * @date 15 March 2025
 */
 
+#include <getopt.h>
+#include <stdarg.h>
 #include "main.h"
 #include "utils.h"
 #include "sys.h"
@@ -39,6 +41,20 @@ SPDX-License-Identifier: GPL-2.0-or-later
 
 bool writeback_enabled;
 
+static struct option long_options[] = {
+	{"prealloc", no_argument, NULL, OPT_PREALLOC},
+	{"numa", required_argument, NULL, OPT_NUMA},
+	{"compress", required_argument, NULL, OPT_COMPRESS},
+	{"mirror", required_argument, NULL, OPT_MIRROR},
+	{"mirror-rate", required_argument, NULL, OPT_MIRROR_RATE},
+	{"clone", required_argument, NULL, OPT_CLONE},
+	{"nt-threshold", required_argument, NULL, OPT_NT_THRESHOLD},
+	{"zoned", required_argument, NULL, OPT_ZONED},
+	{"reserve", required_argument, NULL, OPT_RESERVE},
+	{"movable", no_argument, NULL, OPT_MOVABLE},
+	{NULL, 0, NULL, 0}
+};
+
 void online_menu(char *string)
 {
 	printf("%s is an administration tool to manage RapidDisk RAM disk devices and\n"
@@ -71,17 +87,37 @@ void online_menu(char *string)
 	       "\t\t\tloss on hardware/power failure.\n"
 	       "\t-q\t\tList all system memory and block device resources.\n"
 	       "\t-R\t\tRevalidate size of NVMe export using existing RapidDisk device.\n"
-	       "\t-r\t\tDynamically grow the size of an existing RapidDisk device.\n"
+	       "\t-r\t\tDynamically grow or shrink the size of an existing RapidDisk device.\n"
 	       "\t-s\t\tObtain RapidDisk-Cache Mappings statistics.\n"
 	       "\t-t\t\tDefine the NVMe Target port's transfer protocol (i.e. tcp, rdma or loop).\n"
 	       "\t-U\t\tUnlock a RapidDisk block device (set to read-write).\n"
 	       "\t-u\t\tUnmap a RapidDisk device from another block device.\n"
 	       "\t-v\t\tDisplay the utility version string.\n"
 	       "\t-X\t\tRemove the NVMe Target port (must be unused).\n"
-	       "\t-x\t\tUnexport a RapidDisk block device from an NVMe Target.\n\n");
+	       "\t-x\t\tUnexport a RapidDisk block device from an NVMe Target.\n"
+	       "\t--prealloc\tAllocate all memory of a new RAM disk device at attach time (with -a).\n"
+	       "\t--numa\t\tNUMA placement of a new RAM disk device: local, interleave or bind:N (with -a).\n"
+	       "\t--compress\tStore the pages of a new RAM disk device compressed: lz4 or zstd (with -a).\n"
+	       "\t--mirror\tContinuously persist a new RAM disk device to, and reload it from, a file (with -a).\n"
+	       "\t--mirror-rate\tLimit mirror file writes to this many MBytes per second (with --mirror).\n"
+	       "\t--nt-threshold\tBypass the CPU caches for writes of at least this size, i.e. 256K (with -a).\n"
+	       "\t--zoned\t\tExpose a new RAM disk device as a host managed zoned device with zones of this size (with -a).\n"
+	       "\t--reserve\tGuarantee a new RAM disk device this much memory, i.e. 512M (with -a).\n"
+	       "\t--movable\tLet the kernel move the memory of a new RAM disk device to defragment RAM (with -a).\n"
+	       "\t--clone\t\tAttach a RAM disk device sharing the contents of an existing one (copy on write).\n\n");
         printf("Example Usage:\n\trapiddisk -a 64\n"
+	       "\trapiddisk -a 64 --prealloc\n"
+	       "\trapiddisk -a 64 --numa bind:1\n"
+	       "\trapiddisk -a 64 --compress lz4\n"
+	       "\trapiddisk -a 64 --mirror /var/lib/rapiddisk/rd0.img\n"
+	       "\trapiddisk -a 1024 --nt-threshold 256K\n"
+	       "\trapiddisk -a 8192 --zoned 64M\n"
+	       "\trapiddisk -a 4096 --reserve 1G\n"
+	       "\trapiddisk -a 4096 --movable\n"
+	       "\trapiddisk --clone rd0\n"
 	       "\trapiddisk -d rd2\n"
 	       "\trapiddisk -r rd2 -c 128\n"
+	       "\trapiddisk -r rd2 -c 64\n"
 	       "\trapiddisk -m rd1 -b /dev/sdb\n"
 	       "\trapiddisk -m rd1 -b /dev/sdb -p wt\n"
 	       "\trapiddisk -m rd3 -b /dev/mapper/rc-wa_sdb -p wb\n"
@@ -97,14 +133,39 @@ void online_menu(char *string)
 	       "\trapiddisk -x -b rd3 -P 1 -H nqn.host1\n\n");
 }
 
+/**
+ * It appends one option to the space separated attach options
+ *
+ * @param opts The option string, NAMELEN bytes in size.
+ * @param fmt printf style format of the option, including its trailing space.
+ *
+ * @return SUCCESS, or -ENAMETOOLONG if the option does not fit; opts is then left unchanged
+ */
+static int attach_opts_append(char *opts, const char *fmt, ...)
+{
+	size_t len = strlen(opts);
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(opts + len, NAMELEN - len, fmt, args);
+	va_end(args);
+	if ((n < 0) || ((size_t)n >= NAMELEN - len)) {
+		opts[len] = '\0';
+		return -ENAMETOOLONG;
+	}
+	return SUCCESS;
+}
+
 int exec_cmdline_arg(int argcin, char *argvin[])
 {
 	int rc = INVALID_VALUE, mode = WRITETHROUGH, action = ACTION_NONE, i, port = INVALID_VALUE, xfer = XFER_MODE_TCP;
 	unsigned long long size = 0;
 	bool json_flag = FALSE;
 	bool header_flag = TRUE;
+	bool opts_too_long = FALSE;
 	char device[NAMELEN] = {0}, backing[NAMELEN] = {0}, host[NAMELEN] = {0}, header[NAMELEN] = {0}, sizearg[NAMELEN] = {0};
-	char generic_msg[NAMELEN] = {0};
+	char generic_msg[NAMELEN] = {0}, attach_opts[NAMELEN] = {0};
 	struct RD_PROFILE *disk = NULL;
 	struct RC_PROFILE *cache = NULL;
 	struct MEM_PROFILE *mem = NULL;
@@ -112,7 +173,8 @@ int exec_cmdline_arg(int argcin, char *argvin[])
 
 	sprintf(header, "%s %s\n%s\n\n", PROCESS, VERSION_NUM, COPYRIGHT);
 
-	while ((i = getopt(argcin, argvin, "?:a:b:c:d:ef:gH:hi:jL:lm:NnP:p:qRr:s:t:U:u:VvXx")) != INVALID_VALUE) {
+	while ((i = getopt_long(argcin, argvin, "?:a:b:c:d:ef:gH:hi:jL:lm:NnP:p:qRr:s:t:U:u:VvXx",
+				long_options, NULL)) != INVALID_VALUE) {
 		switch (i) {
 			case 'h':
 				printf("%s", header);
@@ -217,6 +279,37 @@ int exec_cmdline_arg(int argcin, char *argvin[])
 			case 'x':
 				action = ACTION_UNEXPORT_NVMET;
 				break;
+			case OPT_PREALLOC:
+				opts_too_long |= attach_opts_append(attach_opts, "prealloc ") != SUCCESS;
+				break;
+			case OPT_NUMA:
+				opts_too_long |= attach_opts_append(attach_opts, "numa=%s ", optarg) != SUCCESS;
+				break;
+			case OPT_COMPRESS:
+				opts_too_long |= attach_opts_append(attach_opts, "compress=%s ", optarg) != SUCCESS;
+				break;
+			case OPT_MIRROR:
+				opts_too_long |= attach_opts_append(attach_opts, "mirror=%s ", optarg) != SUCCESS;
+				break;
+			case OPT_MIRROR_RATE:
+				opts_too_long |= attach_opts_append(attach_opts, "mirror_rate=%s ", optarg) != SUCCESS;
+				break;
+			case OPT_NT_THRESHOLD:
+				opts_too_long |= attach_opts_append(attach_opts, "nt_threshold=%s ", optarg) != SUCCESS;
+				break;
+			case OPT_ZONED:
+				opts_too_long |= attach_opts_append(attach_opts, "zoned zone_size=%s ", optarg) != SUCCESS;
+				break;
+			case OPT_RESERVE:
+				opts_too_long |= attach_opts_append(attach_opts, "reserve=%s ", optarg) != SUCCESS;
+				break;
+			case OPT_MOVABLE:
+				opts_too_long |= attach_opts_append(attach_opts, "movable ") != SUCCESS;
+				break;
+			case OPT_CLONE:
+				action = ACTION_CLONE;
+				sprintf(device, "%s", optarg);
+				break;
 			default:
 			case '?':
 				printf("%s", header);
@@ -229,6 +322,11 @@ int exec_cmdline_arg(int argcin, char *argvin[])
 		printf("%s", header);
 	}
 
+	if (opts_too_long == TRUE) {
+		print_message(-ENAMETOOLONG, ERR_ATTACH_OPTS, json_flag);
+		return -ENAMETOOLONG;
+	}
+
 	if ((writeback_enabled == FALSE) && (mode == WRITEBACK)) {
 		print_message(-EPERM, ERR_NOWB_MODULE, json_flag);
 		return -EPERM;
@@ -257,7 +355,7 @@ int exec_cmdline_arg(int argcin, char *argvin[])
 					print_message(rc, ERR_INVALID_ARG, json_flag);
 				}
 			} else {
-				rc = mem_device_attach(disk, size, generic_msg);
+				rc = mem_device_attach(disk, size, attach_opts, generic_msg);
 				print_message(rc, generic_msg, json_flag);
 			}
 			break;
@@ -276,6 +374,15 @@ int exec_cmdline_arg(int argcin, char *argvin[])
 			}
 			print_message(rc, generic_msg, json_flag);
 			break;
+		case ACTION_CLONE:
+			if (disk == NULL) {
+				rc = -EINVAL;
+				print_message(rc, ERR_NO_DEVICES, json_flag);
+				break;
+			}
+			rc = mem_device_clone(disk, device, generic_msg);
+			print_message(rc, generic_msg, json_flag);
+			break;
 		case ACTION_FLUSH:
 			rc = mem_device_flush(disk, cache, device, generic_msg);
 			print_message(rc, generic_msg, json_flag);
@@ -316,7 +423,7 @@ int exec_cmdline_arg(int argcin, char *argvin[])
 					}
 					break;
 				}
-				rc = mem_device_resize(disk, device, size, generic_msg);
+				rc = mem_device_resize(disk, cache, device, size, generic_msg);
 			}
 			print_message(rc, generic_msg, json_flag);
 			break;
@@ -52,11 +52,25 @@ SPDX-License-Identifier: GPL-2.0-or-later
 #define ACTION_LOCK			0x10
 #define ACTION_UNLOCK			0x11
 #define ACTION_REVALIDATE_NVMET_SIZE	0x12
+#define ACTION_CLONE			0x13
+
+/* Long only command line options, kept out of the short option character range. */
+#define OPT_PREALLOC			0x100
+#define OPT_NUMA			0x101
+#define OPT_COMPRESS			0x102
+#define OPT_MIRROR			0x104
+#define OPT_MIRROR_RATE			0x105
+#define OPT_CLONE			0x106
+#define OPT_NT_THRESHOLD		0x107
+#define OPT_ZONED			0x108
+#define OPT_RESERVE			0x109
+#define OPT_MOVABLE			0x10a
 
 #define ERR_INVALID_ARG			"Error. Invalid argument(s) or values entered."
 #define ERR_NOWB_MODULE			"Please ensure that the dm-writecache module is loaded and retry."
 #define ERR_NO_DEVICES			"Unable to locate any RapidDisk devices."
 #define ERR_NO_MEMUSAGE			"Error. Unable to retrieve memory usage data."
 #define ERR_INVALID_PORT		"Error. Invalid port number."
+#define ERR_ATTACH_OPTS			"Error. The attach options are too long."
 
 #endif
@@ -238,7 +238,7 @@ static int answer_to_connection(void *cls, struct MHD_Connection *connection, co
 								fprintf(stderr, verbose_msg(msg, error_message), DAEMON);
 							json_status_return(INVALID_VALUE, error_message, &json_str, TRUE);
 						} else {
-							rc = mem_device_attach(disk, size, error_message);
+							rc = mem_device_attach(disk, size, NULL, error_message);
 							json_status_return(rc, error_message, &json_str, TRUE);
 							int pri = LOG_INFO;
 							if (rc < SUCCESS)
@@ -760,21 +760,22 @@ int cache_device_map(struct RD_PROFILE *rd_prof, struct RC_PROFILE *rc_prof, cha
 }
 
 /**
- * It resizes the device
+ * It resizes the device. A smaller size releases the memory past the new end
+ * and discards any data stored there.
  *
  * @param prof This is a pointer to the linked list of RD_PROFILE structures.
+ * @param rc_prof This is a pointer to the linked list of RC_PROFILE structures.
  * @param string The device name
  * @param size The size of the device in Mbytes
  * @param return_message This is a pointer to a buffer that will contain the return message.
  *
  * @return The return value is SUCCESS upon result
  */
-int mem_device_resize(struct RD_PROFILE *prof, char *string, unsigned long long size, char *return_message)
+int mem_device_resize(struct RD_PROFILE *prof, struct RC_PROFILE *rc_prof, char *string, unsigned long long size, char *return_message)
 {
-	int rc = INVALID_VALUE, fd;
+	int rc = INVALID_VALUE;
 	FILE *fp = NULL;
-	char file[NAMELEN] = {0};
-	unsigned long long max_sectors = 0, rd_size = 0;
+	unsigned long long rd_size = 0;
 	char *msg;
 
 	/* echo "rapiddisk resize 1 131072 " > /sys/kernel/rapiddisk/mgmt */
@@ -790,35 +791,23 @@ int mem_device_resize(struct RD_PROFILE *prof, char *string, unsigned long long
 		return -ENOENT;
 	}
 
-	sprintf(file, "/dev/%s", string);
-
-	if ((fd = open(file, O_WRONLY)) < SUCCESS) {
-		msg = "%s: open: %s";
-		print_error(msg, return_message, __func__, strerror(errno));
-		return -ENOENT;
-	}
-
-	/**
-	 * TODO: check why max_sectors is 0 in some cases
-	 */
-	if ((ioctl(fd, IOCTL_RD_GET_STATS, &max_sectors)) == INVALID_VALUE) {
-		msg = "%s: ioctl: %s";
-		print_error(msg, return_message, __func__, strerror(errno));
-		close(fd);
-		return -EIO;
+	if ((size * 1024) == (rd_size / 1024)) {
+		msg = "Error. Size is currently set to %llu Mbytes. Please specify a different size.";
+		print_error(msg, return_message, (rd_size / 1024) / 1024);
+		return -EINVAL;
 	}
 
-	close(fd);
-
-	if ((((size * 1024 * 1024) / BYTES_PER_BLOCK) <= (max_sectors)) || ((size * 1024) == (rd_size / 1024))) {
-		if ((size * 1024) == (rd_size / 1024)) {
-			msg = "Error. Size is currently set to %llu Mbytes. Please specify a size larger than %llu Mbytes.";
-			print_error(msg, return_message, (rd_size / 1024) / 1024, (((max_sectors * BYTES_PER_BLOCK) / 1024) / 1024));
-		} else {
-			msg = "Error. Please specify a size larger than %llu Mbytes.";
-			print_error(msg, return_message, (((max_sectors * BYTES_PER_BLOCK) / 1024) / 1024));
+	/* A cache mapping was sized for the current capacity */
+	if ((size * 1024 * 1024) < rd_size) {
+		while (rc_prof != NULL) {
+			if (strcmp(string, rc_prof->cache) == SUCCESS) {
+				msg = "Error. Unable to shrink %s. This RapidDisk device is currently"
+							" mapped as a cache drive to %s.";
+				print_error(msg, return_message, string, rc_prof->device);
+				return -EBUSY;
+			}
+			rc_prof = rc_prof->next;
 		}
-		return -EINVAL;
 	}
 
 	/* This is where we begin to detach the block device */
@@ -839,54 +828,137 @@ int mem_device_resize(struct RD_PROFILE *prof, char *string, unsigned long long
 	return SUCCESS;
 }
 
+/**
+ * It picks the number for a new device: the lowest one not in use. With N
+ * devices attached, one of the numbers 0 to N is always free.
+ *
+ * @param prof This is a pointer to the linked list of RD_PROFILE structures.
+ *
+ * @return The number of the next device to attach, or -ENOMEM
+ */
+static int mem_device_next_num(struct RD_PROFILE *prof)
+{
+	struct RD_PROFILE *tmp;
+	unsigned long num, total = 0;
+	unsigned char *used;
+	int dsk;
+
+	for (tmp = prof; tmp != NULL; tmp = tmp->next)
+		total++;
+
+	if ((used = calloc(total + 1, sizeof(*used))) == NULL)
+		return -ENOMEM;
+	for (tmp = prof; tmp != NULL; tmp = tmp->next) {
+		num = strtoul(tmp->device + 2, NULL, 10);
+		if (num <= total)
+			used[num] = 1;
+	}
+	for (dsk = 0; used[dsk]; dsk++)
+		;
+	free(used);
+	return dsk;
+}
+
 /**
  * It attaches a new device to the kernel
  *
  * @param prof This is a pointer to the linked list of RD_PROFILE structures.
  * @param size size of the device in Mbytes
+ * @param options optional space separated attach parameters (i.e. "prealloc"), or NULL
  * @param return_message This is a pointer to a buffer that will contain the error message if the function fails.
  *
  * @return The return value is SUCCESS upon result
  */
-int mem_device_attach(struct RD_PROFILE *prof, unsigned long long size, char *return_message)
+int mem_device_attach(struct RD_PROFILE *prof, unsigned long long size, const char *options, char *return_message)
 {
 	int dsk;
 	FILE *fp = NULL;
-	char string[BUFSZ] = {0}, name[16] = {0};
 	char *msg;
 
 	/* echo "rapiddisk attach 65536" > /sys/kernel/rapiddisk/mgmt <- in bytes */
-	for (dsk = 0; prof != NULL; dsk++) {
-		strcat(string, ",");
-		strcat(string, prof->device);
-		prof = prof->next;
-	}
-
-	while (dsk >= 0) {
-		sprintf(name, "rd%d", dsk);
-		if (strstr(string, (const char *)name) == NULL) {
-			break;
-		}
-		dsk--;
+	dsk = mem_device_next_num(prof);
+	if (dsk < 0) {
+		msg = "%s: calloc: %s";
+		print_error(msg, return_message, __func__, strerror(-dsk));
+		return dsk;
 	}
 	if ((fp = fopen(SYS_RDSK, "w")) == NULL) {
 		msg = "%s: fopen: %s: %s";
 		print_error(msg, return_message, __func__, SYS_RDSK, strerror(errno));
 		return -ENOENT;
 	}
-	if (fprintf(fp, "rapiddisk attach %d %llu\n", dsk,
-				(size * 1024 * 1024)) < 0) {
+	if (fprintf(fp, "rapiddisk attach %d %llu %s\n", dsk,
+				(size * 1024 * 1024), (options ? options : "")) < 0) {
 		msg = "%s: fprintf: %s";
 		print_error(msg, return_message, __func__, strerror(errno));
 		fclose(fp);
 		return -EIO;
 	}
 
-	fclose(fp);
+	/* The module only reports a rejected attach (i.e. prealloc out of memory) on flush. */
+	if (fclose(fp) != 0) {
+		msg = "%s: fclose: %s";
+		print_error(msg, return_message, __func__, strerror(errno));
+		return -EIO;
+	}
 	print_error("Attached device rd%d of size %llu Mbytes.", return_message, dsk, size);
 	return SUCCESS;
 }
 
+/**
+ * It attaches a new device that shares the pages of an existing one until
+ * either of them is written
+ *
+ * @param prof This is a pointer to the linked list of RD_PROFILE structures.
+ * @param string The name of the device to clone
+ * @param return_message This is a pointer to a buffer that will contain the return message.
+ *
+ * @return The return value is SUCCESS upon result
+ */
+int mem_device_clone(struct RD_PROFILE *prof, char *string, char *return_message)
+{
+	int rc = INVALID_VALUE, dsk;
+	FILE *fp = NULL;
+	char *msg;
+
+	/* echo "rapiddisk clone 0 1" > /sys/kernel/rapiddisk/mgmt */
+	dsk = mem_device_next_num(prof);
+	if (dsk < 0) {
+		msg = "%s: calloc: %s";
+		print_error(msg, return_message, __func__, strerror(-dsk));
+		return dsk;
+	}
+	while (prof != NULL) {
+		if (strcmp(string, prof->device) == SUCCESS)
+			rc = SUCCESS;
+		prof = prof->next;
+	}
+	if (rc != SUCCESS) {
+		print_error(ERR_DEV_NOEXIST, return_message, string);
+		return -ENOENT;
+	}
+
+	if ((fp = fopen(SYS_RDSK, "w")) == NULL) {
+		msg = "%s: fopen: %s: %s";
+		print_error(msg, return_message, __func__, SYS_RDSK, strerror(errno));
+		return -ENOENT;
+	}
+	if (fprintf(fp, "rapiddisk clone %s %d\n", string + 2, dsk) < 0) {
+		msg = "%s: fprintf: %s";
+		print_error(msg, return_message, __func__, strerror(errno));
+		fclose(fp);
+		return -EIO;
+	}
+	/* A rejected clone (i.e. a compressed source) is reported on flush. */
+	if (fclose(fp) != 0) {
+		msg = "%s: fclose: %s";
+		print_error(msg, return_message, __func__, strerror(errno));
+		return -EIO;
+	}
+	print_error("Cloned device %s to rd%d.", return_message, string, dsk);
+	return SUCCESS;
+}
+
 /**
  * It detaches a RapidDisk device from the system
  *
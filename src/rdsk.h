@@ -51,8 +51,9 @@ struct RC_PROFILE *search_cache_targets(char *return_message);
 void *dm_get_status(char *device, enum CACHE_TYPE cache_type);
 int dm_create_mapping(char* device, char *table);
 int cache_device_map(struct RD_PROFILE *rd_prof, struct RC_PROFILE *rc_prof, char *ramdisk, char *block_dev, int cache_mode, char *return_message);
-int mem_device_resize(struct RD_PROFILE *prof, char *string, unsigned long long size, char *return_message);
-int mem_device_attach(struct RD_PROFILE *, unsigned long long, char *return_message);
+int mem_device_resize(struct RD_PROFILE *prof, struct RC_PROFILE *rc_prof, char *string, unsigned long long size, char *return_message);
+int mem_device_attach(struct RD_PROFILE *, unsigned long long, const char *options, char *return_message);
+int mem_device_clone(struct RD_PROFILE *, char *, char *return_message);
 int mem_device_detach(struct RD_PROFILE *, struct RC_PROFILE *, char *, char *return_message);
 int mem_device_lock(struct RD_PROFILE *, char *, bool, char *return_message);
 int cache_device_unmap(struct RC_PROFILE *, char *, char *return_message);
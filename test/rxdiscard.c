@@ -0,0 +1,130 @@
+/* rxdiscard.c */
+
+/** Copyright © 2016 - 2025 Petros Koutoupis
+ ** All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 2 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ** SPDX-License-Identifier: GPL-2.0-or-later
+ **/
+
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <errno.h>
+#include <string.h>
+
+#define IOCTL_RD_GET_USAGE	0x0530
+#define BUFSZ			(1024 * 1024)
+
+/* Discard a 1 MB region (and then a single sector) and verify that the
+ * pages are given back and that the discarded data reads back as zeros. */
+int main () {
+	int fd, i;
+	unsigned long long before, after;
+	uint64_t range[2];
+	char *buf;
+
+	if ((fd = open("/dev/rd0", O_RDWR)) < 0) {
+		printf("%s\n", strerror(errno));
+		return errno;
+	}
+
+	if ((buf = malloc(BUFSZ)) == NULL) {
+		printf("%s\n", strerror(errno));
+		close (fd);
+		return ENOMEM;
+	}
+	memset(buf, 0xaa, BUFSZ);
+
+	if ((pwrite(fd, buf, BUFSZ, 0) != BUFSZ) || (fsync(fd) != 0)) {
+		printf("%s\n", strerror(errno));
+		goto out;
+	}
+	ioctl(fd, BLKFLSBUF, 0);
+
+	if (ioctl(fd, IOCTL_RD_GET_USAGE, &before) == -1) {
+		printf("%s\n", strerror(errno));
+		goto out;
+	}
+
+	range[0] = 0;
+	range[1] = BUFSZ;
+	if (ioctl(fd, BLKDISCARD, &range) == -1) {
+		printf("BLKDISCARD: %s\n", strerror(errno));
+		goto out;
+	}
+
+	if (ioctl(fd, IOCTL_RD_GET_USAGE, &after) == -1) {
+		printf("%s\n", strerror(errno));
+		goto out;
+	}
+	printf("pages allocated before discard: %llu, after discard: %llu\n", before, after);
+	if (after >= before) {
+		printf("Error. Discard did not free any pages.\n");
+		errno = EIO;
+		goto out;
+	}
+
+	if (pread(fd, buf, BUFSZ, 0) != BUFSZ) {
+		printf("%s\n", strerror(errno));
+		goto out;
+	}
+	for (i = 0; i < BUFSZ; i++) {
+		if (buf[i] != 0) {
+			printf("Error. Non-zero data at offset %d after discard.\n", i);
+			errno = EIO;
+			goto out;
+		}
+	}
+
+	/* A sub-page discard must succeed and zero only the discarded sector. */
+	memset(buf, 0xaa, 4096);
+	if ((pwrite(fd, buf, 4096, 0) != 4096) || (fsync(fd) != 0)) {
+		printf("%s\n", strerror(errno));
+		goto out;
+	}
+	range[0] = 512;
+	range[1] = 512;
+	if (ioctl(fd, BLKDISCARD, &range) == -1) {
+		printf("BLKDISCARD (partial page): %s\n", strerror(errno));
+		goto out;
+	}
+	ioctl(fd, BLKFLSBUF, 0);
+	if (pread(fd, buf, 4096, 0) != 4096) {
+		printf("%s\n", strerror(errno));
+		goto out;
+	}
+	for (i = 0; i < 4096; i++) {
+		if (buf[i] != (((i >= 512) && (i < 1024)) ? 0 : (char)0xaa)) {
+			printf("Error. Unexpected data at offset %d after partial discard.\n", i);
+			errno = EIO;
+			goto out;
+		}
+	}
+	printf("Discard test passed.\n");
+	errno = 0;
+
+out:
+	free(buf);
+	close (fd);
+
+	return errno;
+}
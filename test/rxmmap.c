@@ -0,0 +1,109 @@
+/* rxmmap.c */
+
+/** Copyright © 2016 - 2025 Petros Koutoupis
+ ** All rights reserved.
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU General Public License as published by
+ ** the Free Software Foundation, either version 2 of the License, or
+ ** (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU General Public License for more details.
+ **
+ ** You should have received a copy of the GNU General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ ** SPDX-License-Identifier: GPL-2.0-or-later
+ **/
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <errno.h>
+#include <string.h>
+
+#define IOCTL_RD_BLKFLSBUF	0x0531
+#define BUFSZ			(1024 * 1024)
+
+/* Store through a mapping of /dev/rd0_mem and read it back with direct I/O
+ * on /dev/rd0 (and the other way around), then verify that a flush of the
+ * mapped device is refused. */
+int main () {
+	int fd, mfd, i;
+	char *map, *buf;
+
+	if ((fd = open("/dev/rd0", O_RDWR | O_DIRECT)) < 0) {
+		printf("%s\n", strerror(errno));
+		return errno;
+	}
+	if ((mfd = open("/dev/rd0_mem", O_RDWR)) < 0) {
+		printf("%s\n", strerror(errno));
+		close (fd);
+		return errno;
+	}
+
+	if (posix_memalign((void **)&buf, 4096, BUFSZ) != 0) {
+		printf("%s\n", strerror(ENOMEM));
+		close (mfd);
+		close (fd);
+		return ENOMEM;
+	}
+	map = mmap(NULL, BUFSZ, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+	if (map == MAP_FAILED) {
+		printf("mmap: %s\n", strerror(errno));
+		goto out;
+	}
+
+	memset(map, 0x5a, BUFSZ);
+	if (pread(fd, buf, BUFSZ, 0) != BUFSZ) {
+		printf("%s\n", strerror(errno));
+		goto out_unmap;
+	}
+	for (i = 0; i < BUFSZ; i++) {
+		if (buf[i] != 0x5a) {
+			printf("Error. Block read does not see mapped store at offset %d.\n", i);
+			errno = EIO;
+			goto out_unmap;
+		}
+	}
+
+	memset(buf, 0xa5, BUFSZ);
+	if (pwrite(fd, buf, BUFSZ, 0) != BUFSZ) {
+		printf("%s\n", strerror(errno));
+		goto out_unmap;
+	}
+	for (i = 0; i < BUFSZ; i++) {
+		if (map[i] != (char)0xa5) {
+			printf("Error. Mapping does not see block write at offset %d.\n", i);
+			errno = EIO;
+			goto out_unmap;
+		}
+	}
+
+	if (ioctl(fd, IOCTL_RD_BLKFLSBUF, 0) != -1 || errno != EBUSY) {
+		printf("Error. Flush of a mapped device was not refused.\n");
+		errno = EIO;
+		goto out_unmap;
+	}
+	printf("Mmap test passed.\n");
+	errno = 0;
+
+out_unmap:
+	munmap(map, BUFSZ);
+out:
+	free(buf);
+	close (mfd);
+	close (fd);
+
+	return errno;
+}